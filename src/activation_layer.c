@@ -1,68 +1,242 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include "uwnet.h"
 
+// e^x without a libm call, within about 1 ulp of expf
+// x is split into k*ln(2) + r with |r| <= ln(2)/2, e^r comes from a
+// degree 7 polynomial and 2^k is built directly in the exponent bits.
+// Everything is branch free so loops calling it vectorize. Inputs are
+// clamped to [-87.33, 88.38], where 2^k and the result stay normal
+// floats, so very negative inputs give about 1e-38 rather than 0.
+// float x: exponent
+// returns: e^x
+static inline float fast_expf(float x)
+{
+    x = x > 88.3762626647949f ? 88.3762626647949f : x;
+    x = x < -87.33f ? -87.33f : x;
+    // Round to nearest by hand, floorf has no vector form without SSE4.1
+    float t = x*1.44269504088896341f;
+    int k = (int)(t + (t > 0 ? .5f : -.5f));
+    // Reduce in double: a float Cody-Waite split gets reassociated away
+    // under -Ofast, and the rounding of k*ln(2) would then cost ~30 ulp
+    float r = (float)((double)x - k*0.693147180559945309);
+    float y = 1.9875691500E-4f;
+    y = y*r + 1.3981999507E-3f;
+    y = y*r + 8.3334519073E-3f;
+    y = y*r + 4.1665795894E-2f;
+    y = y*r + 1.6666665459E-1f;
+    y = y*r + 5.0000001201E-1f;
+    y = y*r*r + r + 1;
+    int bits = (k + 127) << 23;
+    float p;
+    memcpy(&p, &bits, sizeof(p));
+    return y*p;
+}
+
+// Write e^(x - shift) into out and sum it, in one vectorized pass
+// float *x: input
+// int n: number of elements
+// float shift: subtracted from x first, its max keeps e^x from overflowing
+// float *out: output, may be x
+// returns: sum of the outputs
+float exp_shifted(float *x, int n, float shift, float *out)
+{
+    int i;
+    float sum = 0;
+    for(i = 0; i < n; ++i){
+        out[i] = fast_expf(x[i] - shift);
+        sum += out[i];
+    }
+    return sum;
+}
+
+// Apply an elementwise activation to an array in place
+// Each activation has its own loop so the choice is made once per array,
+// not per element. Softmax is taken over the whole array, shifted by its
+// max so large inputs don't overflow.
+// float *x: array to activate
+// int n: number of elements
+// ACTIVATION a: activation to apply
+void activate_array(float *x, int n, ACTIVATION a)
+{
+    int i;
+    if(a == LOGISTIC){
+        for(i = 0; i < n; ++i) x[i] = 1/(1+fast_expf(-x[i]));
+    } else if (a == RELU){
+        for(i = 0; i < n; ++i) x[i] = (x[i]>0)*x[i];
+    } else if (a == LRELU){
+        for(i = 0; i < n; ++i) x[i] = (x[i]>0) ? x[i] : .01f*x[i];
+    } else if (a == SOFTMAX){
+        float max = x[0];
+        for(i = 1; i < n; ++i) max = x[i] > max ? x[i] : max;
+        float scale = 1/exp_shifted(x, n, max, x);
+        for(i = 0; i < n; ++i) x[i] *= scale;
+    }
+}
+
+// Add biases to a finished row of a GEMM result and activate it
+// Passed to gemm_epilogue by layers that apply y = f(xw + b).
+// float *c: the row, n floats
+// int i: index of the row
+// int n: length of the row
+// void *arg: a bias_activation
+void bias_activation_epilogue(float *c, int i, int n, void *arg)
+{
+    bias_activation *ba = arg;
+    assert(ba->a != SOFTMAX);
+    int j;
+    if(ba->bias && ba->per_row){
+        for(j = 0; j < n; ++j) c[j] += ba->bias[i];
+    } else if(ba->bias){
+        for(j = 0; j < n; ++j) c[j] += ba->bias[j];
+    }
+    activate_array(c, n, ba->a);
+}
+
+// Multiply deltas by an activation's derivative
+// float *x: activation inputs
+// int n: number of elements
+// ACTIVATION a: activation
+// float *delta: dL/dy, multiplied in place into dL/dx
+void gradient_array(float *x, int n, ACTIVATION a, float *delta)
+{
+    int i;
+    if(a == LOGISTIC){
+        for(i = 0; i < n; ++i){
+            float fx = 1/(1 + fast_expf(-x[i]));
+            delta[i] *= fx*(1-fx);
+        }
+    } else if (a == RELU){
+        for(i = 0; i < n; ++i) delta[i] *= (x[i]>0) ? 1 : 0;
+    } else if (a == LRELU){
+        for(i = 0; i < n; ++i) delta[i] *= (x[i]>0) ? 1 : .01f;
+    }
+}
+
+// Bytes of backward state an activation keeps per row of outputs: one
+// bit per element for relu and lrelu, the outputs for logistic (so exp
+// isn't recomputed) and nothing for linear and softmax
+// ACTIVATION a: activation
+// int n: elements per row
+int activation_state_bytes(ACTIVATION a, int n)
+{
+    if(a == RELU || a == LRELU) return (n + 7)/8;
+    if(a == LOGISTIC) return n*sizeof(float);
+    return 0;
+}
+
+// Save an activation's backward state for one row of its outputs
+// relu and lrelu outputs are > 0 exactly where their inputs are, so the
+// mask comes from y.
+// float *y: activated outputs
+// int n: number of elements
+// ACTIVATION a: activation
+// unsigned char *state: activation_state_bytes(a, n) of output
+void save_activation_row(float *y, int n, ACTIVATION a, unsigned char *state)
+{
+    int i, k;
+    if(a == LOGISTIC){
+        memcpy(state, y, n*sizeof(float));
+    } else if(a == RELU || a == LRELU){
+        for(i = 0; i < n/8; ++i){
+            unsigned char b = 0;
+            for(k = 0; k < 8; ++k) b |= (y[8*i + k] > 0) << k;
+            state[i] = b;
+        }
+        if(n % 8){
+            unsigned char b = 0;
+            for(k = 0; k < n % 8; ++k) b |= (y[8*i + k] > 0) << k;
+            state[i] = b;
+        }
+    }
+}
+
+// Get room for a layer's activation state, if it needs any
+// layer l: layer whose outputs are activated with l.activation
+// int rows, cols: size of the outputs
+// returns: state buffer, or 0 outside of TRAIN or if there is nothing to keep
+unsigned char *activation_state(layer l, int rows, int cols)
+{
+    int bytes = activation_state_bytes(l.activation, cols);
+    if(l.mode != TRAIN || !bytes) return 0;
+    *l.activation_state = realloc(*l.activation_state, (size_t)rows*bytes);
+    return *l.activation_state;
+}
+
+// Save the backward state of a layer's activated outputs
+// layer l: layer that made y
+// matrix y: its outputs
+void save_activation_state(layer l, matrix y)
+{
+    int bytes = activation_state_bytes(l.activation, y.cols);
+    unsigned char *state = activation_state(l, y.rows, y.cols);
+    int i;
+    if(!state) return;
+    #pragma omp parallel for
+    for(i = 0; i < y.rows; ++i){
+        save_activation_row(y.data + i*y.cols, y.cols, l.activation, state + i*bytes);
+    }
+}
+
+// Multiply deltas by the activation's derivative using the saved state
+// Softmax is taken to have f'(x) = 1, see backward_activation_layer.
+// layer l: layer whose forward saved the state
+// matrix d: dL/dy, multiplied in place into dL/dx
+void activation_state_gradient(layer l, matrix d)
+{
+    ACTIVATION a = l.activation;
+    int bytes = activation_state_bytes(a, d.cols);
+    int i, j;
+    if(a != LOGISTIC && a != RELU && a != LRELU) return;
+    float slope = a == LRELU ? .01f : 0;
+    #pragma omp parallel for private(j)
+    for(i = 0; i < d.rows; ++i){
+        float *dr = d.data + i*d.cols;
+        unsigned char *state = *l.activation_state + i*bytes;
+        if(a == LOGISTIC){
+            float *y = (float *)state;
+            for(j = 0; j < d.cols; ++j) dr[j] *= y[j]*(1-y[j]);
+        } else {
+            for(j = 0; j < d.cols; ++j) dr[j] *= ((state[j >> 3] >> (j & 7)) & 1) ? 1 : slope;
+        }
+    }
+}
 
 // Run an activation layer on input
 // layer l: pointer to layer to run
-// matrix x: input to layer
+// matrix x: input to layer, overwritten and returned if l.in_place
 // returns: the result of running the layer y = f(x)
 matrix forward_activation_layer(layer l, matrix x)
 {
-    // Saving our input
-    // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
-
     ACTIVATION a = l.activation;
-    matrix y = copy_matrix(x);
+    int bytes = activation_state_bytes(a, x.cols);
+    int i;
+    matrix y = l.in_place ? x : copy_matrix(x);
+    unsigned char *state = activation_state(l, y.rows, y.cols);
 
-    // TODO: 2.1
-    // apply the activation function to matrix y
     // logistic(x) = 1/(1+e^(-x))
     // relu(x)     = x if x > 0 else 0
     // lrelu(x)    = x if x > 0 else .01 * x
-    // softmax(x)  = e^{x_i} / sum(e^{x_j}) for all x_j in the same row 
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        float sum = 0;
-        for(j = 0; j < x.cols; ++j){
-            int index = i*x.cols + j;
-            float v = x.data[index];
-            if(a == LOGISTIC){
-                y.data[index] = 1/(1+expf(-v));
-            } else if (a == RELU){
-                y.data[index] = (v>0)*v;
-            } else if (a == LRELU){
-                y.data[index] = (v>0) ? v : .01*v;
-            } else if (a == SOFTMAX){
-                y.data[index] = expf(v);
-            }
-            sum += y.data[index];
-        }
-        if (a == SOFTMAX) {
-            for(j = 0; j < x.cols; ++j){
-                int index = i*x.cols + j;
-                y.data[index] /= sum;
-            }
-        }
+    // softmax(x)  = e^{x_i} / sum(e^{x_j}) for all x_j in the same row
+    #pragma omp parallel for
+    for(i = 0; i < y.rows; ++i){
+        activate_array(y.data + i*y.cols, y.cols, a);
+        if(state) save_activation_row(y.data + i*y.cols, y.cols, a, state + i*bytes);
     }
-
     return y;
 }
 
 // Run an activation layer on input
 // layer l: pointer to layer to run
-// matrix dy: derivative of loss wrt output, dL/dy
+// matrix dy: derivative of loss wrt output, dL/dy, overwritten and
+// returned if l.in_place
 // returns: derivative of loss wrt input, dL/dx
 matrix backward_activation_layer(layer l, matrix dy)
 {
-    matrix x = *l.x;
-    matrix dx = copy_matrix(dy);
-    ACTIVATION a = l.activation;
+    matrix dx = l.in_place ? dy : copy_matrix(dy);
 
-    // TODO: 2.2
     // calculate dL/dx = f'(x) * dL/dy
     // assume for this part that f'(x) = 1 for softmax because we will only use
     // it with cross-entropy loss for classification and include it in the loss
@@ -71,22 +245,7 @@ matrix backward_activation_layer(layer l, matrix dy)
     // d/dx relu(x)     = 1 if x > 0 else 0
     // d/dx lrelu(x)    = 1 if x > 0 else 0.01
     // d/dx softmax(x)  = 1
-
-    int i, j;
-    for(i = 0; i < dx.rows; ++i){
-        for(j = 0; j < dx.cols; ++j){
-            float v = x.data[i*x.cols + j];
-            if(a == LOGISTIC){
-                float fx = 1/(1 + exp(-v));
-                dx.data[i*dx.cols + j] *= fx*(1-fx);
-            } else if (a == RELU){
-                dx.data[i*dx.cols + j] *= (v>0) ? 1 : 0;
-            } else if (a == LRELU){
-                dx.data[i*dx.cols + j] *= (v>0) ? 1 : 0.01;
-            }
-        }
-    }
-
+    activation_state_gradient(l, dx);
     return dx;
 }
 
@@ -101,7 +260,7 @@ layer make_activation_layer(ACTIVATION a)
 {
     layer l = {0};
     l.activation = a;
-    l.x = calloc(1, sizeof(matrix));
+    l.activation_state = calloc(1, sizeof(unsigned char *));
     l.forward = forward_activation_layer;
     l.backward = backward_activation_layer;
     l.update = update_activation_layer;
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <string.h>
+#include "uwnet.h"
+
+// Average pooling only needs dL/dy to go backward, so neither layer here
+// saves its input. Windows are placed like maxpool's and only average the
+// elements inside the image.
+
+// Count the in-bounds elements of each window along one axis
+// int n: input length
+// int outn: number of outputs
+// int size, stride: window size and stride
+// float *count: output, number of in-bounds elements of each window
+void avgpool_counts(int n, int outn, int size, int stride, float *count)
+{
+  int pad = (size-1)/2;
+  int o, k;
+  for (o = 0; o < outn; ++o) {
+    count[o] = 0;
+    for (k = 0; k < size; ++k) {
+      int i = o*stride + k - pad;
+      count[o] += (i >= 0 && i < n);
+    }
+  }
+}
+
+// Average pool one CHW plane
+// Like maxpool, a whole output row is summed one window tap at a time over
+// that tap's in-bounds columns, so the interior loop is branch free.
+// layer l: layer to run
+// float *in: input plane
+// float *cy, *cx: window counts along each axis, see avgpool_counts
+// float *out: window averages, outw*outh
+void avgpool_chw(layer l, float *in, float *cy, float *cx, float *out)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2;
+  int oy, ox, ky, kx;
+  for (oy = 0; oy < outh; ++oy) {
+    float *y = out + oy*outw;
+    memset(y, 0, outw*sizeof(float));
+    for (ky = 0; ky < l.size; ++ky) {
+      int iy = oy*l.stride + ky - pad;
+      if (iy < 0 || iy >= l.height) continue;
+      for (kx = 0; kx < l.size; ++kx) {
+        int x0, x1;
+        valid_range(l.width, outw, kx - pad, l.stride, &x0, &x1);
+        float *x = in + iy*l.width + kx - pad;
+        for (ox = x0; ox < x1; ++ox) y[ox] += x[ox*l.stride];
+      }
+    }
+    for (ox = 0; ox < outw; ++ox) y[ox] /= cy[oy]*cx[ox];
+  }
+}
+
+// Run an average pool backward on one CHW plane
+// layer l: layer to run
+// float *dy: dL/dy for the plane
+// float *cy, *cx: window counts along each axis
+// float *scaled: outw floats of scratch
+// float *dx: dL/dx for the plane, accumulated into
+void backward_avgpool_chw(layer l, float *dy, float *cy, float *cx, float *scaled, float *dx)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2;
+  int oy, ox, ky, kx;
+  for (oy = 0; oy < outh; ++oy) {
+    for (ox = 0; ox < outw; ++ox) scaled[ox] = dy[oy*outw + ox]/(cy[oy]*cx[ox]);
+    for (ky = 0; ky < l.size; ++ky) {
+      int iy = oy*l.stride + ky - pad;
+      if (iy < 0 || iy >= l.height) continue;
+      for (kx = 0; kx < l.size; ++kx) {
+        int x0, x1;
+        valid_range(l.width, outw, kx - pad, l.stride, &x0, &x1);
+        float *d = dx + iy*l.width + kx - pad;
+        for (ox = x0; ox < x1; ++ox) d[ox*l.stride] += scaled[ox];
+      }
+    }
+  }
+}
+
+// Run an average pool forward or backward on one HWC example
+// Channels are contiguous, so each window tap updates a whole pixel.
+// layer l: layer to run
+// float *x: input (forward) or dL/dx (backward) for the example
+// float *y: output (forward) or dL/dy (backward) for the example
+// float *cy, *cx: window counts along each axis
+// int backward: 0 to average x into y, 1 to spread y back into x
+void avgpool_hwc(layer l, float *x, float *y, float *cy, float *cx, int backward)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2;
+  int c = l.channels;
+  int oy, ox, ky, kx, k;
+  for (oy = 0; oy < outh; ++oy) {
+    for (ox = 0; ox < outw; ++ox) {
+      float *yp = y + (oy*outw + ox)*c;
+      float scale = 1.f/(cy[oy]*cx[ox]);
+      if (!backward) memset(yp, 0, c*sizeof(float));
+      for (ky = 0; ky < l.size; ++ky) {
+        int iy = oy*l.stride + ky - pad;
+        if (iy < 0 || iy >= l.height) continue;
+        for (kx = 0; kx < l.size; ++kx) {
+          int ix = ox*l.stride + kx - pad;
+          if (ix < 0 || ix >= l.width) continue;
+          float *xp = x + (iy*l.width + ix)*c;
+          if (backward) {
+            for (k = 0; k < c; ++k) xp[k] += scale*yp[k];
+          } else {
+            for (k = 0; k < c; ++k) yp[k] += xp[k];
+          }
+        }
+      }
+      if (!backward) for (k = 0; k < c; ++k) yp[k] *= scale;
+    }
+  }
+}
+
+// Run an average pool layer on input
+// layer l: pointer to layer to run
+// matrix in: input to layer
+// returns: the result of running the layer
+matrix forward_avgpool_layer(layer l, matrix in)
+{
+  assert(in.cols == l.width*l.height*l.channels);
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int p;
+  matrix out = make_matrix_garbage(in.rows, outw*outh*l.channels);
+  float *cy = calloc(outh + outw, sizeof(float));
+  float *cx = cy + outh;
+  avgpool_counts(l.height, outh, l.size, l.stride, cy);
+  avgpool_counts(l.width, outw, l.size, l.stride, cx);
+
+  if (l.layout == NHWC) {
+    #pragma omp parallel for
+    for (p = 0; p < in.rows; ++p) {
+      avgpool_hwc(l, in.data + p*in.cols, out.data + p*out.cols, cy, cx, 0);
+    }
+  } else {
+    #pragma omp parallel for
+    for (p = 0; p < in.rows*l.channels; ++p) {
+      avgpool_chw(l, in.data + p*l.width*l.height, cy, cx, out.data + p*outw*outh);
+    }
+  }
+  free(cy);
+  return out;
+}
+
+// Run an average pool layer backward
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+matrix backward_avgpool_layer(layer l, matrix dy)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int p;
+  matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
+  float *cy = calloc(outh + outw, sizeof(float));
+  float *cx = cy + outh;
+  avgpool_counts(l.height, outh, l.size, l.stride, cy);
+  avgpool_counts(l.width, outw, l.size, l.stride, cx);
+
+  if (l.layout == NHWC) {
+    #pragma omp parallel for
+    for (p = 0; p < dy.rows; ++p) {
+      avgpool_hwc(l, dx.data + p*dx.cols, dy.data + p*dy.cols, cy, cx, 1);
+    }
+  } else {
+    #pragma omp parallel
+    {
+      float *scaled = calloc(outw, sizeof(float));
+      #pragma omp for
+      for (p = 0; p < dy.rows*l.channels; ++p) {
+        backward_avgpool_chw(l, dy.data + p*outw*outh, cy, cx, scaled, dx.data + p*l.width*l.height);
+      }
+      free(scaled);
+    }
+  }
+  free(cy);
+  return dx;
+}
+
+// Run a global average pool layer on input
+// Each channel is averaged down to one value, output is 1x1xc
+// layer l: pointer to layer to run
+// matrix in: input to layer
+// returns: the result of running the layer
+matrix forward_global_avgpool_layer(layer l, matrix in)
+{
+  assert(in.cols == l.width*l.height*l.channels);
+  int spatial = l.width*l.height;
+  int c = l.channels;
+  int i;
+  matrix out = make_matrix(in.rows, c);
+
+  #pragma omp parallel for
+  for (i = 0; i < in.rows; ++i) {
+    float *x = in.data + i*in.cols;
+    float *y = out.data + i*out.cols;
+    int j, k;
+    if (l.layout == NHWC) {
+      for (j = 0; j < spatial; ++j) {
+        for (k = 0; k < c; ++k) y[k] += x[j*c + k];
+      }
+    } else {
+      for (k = 0; k < c; ++k) {
+        float sum = 0;
+        for (j = 0; j < spatial; ++j) sum += x[k*spatial + j];
+        y[k] = sum;
+      }
+    }
+    for (k = 0; k < c; ++k) y[k] /= spatial;
+  }
+  return out;
+}
+
+// Run a global average pool layer backward
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+matrix backward_global_avgpool_layer(layer l, matrix dy)
+{
+  int spatial = l.width*l.height;
+  int c = l.channels;
+  int i;
+  matrix dx = make_matrix_garbage(dy.rows, spatial*c);
+
+  #pragma omp parallel for
+  for (i = 0; i < dy.rows; ++i) {
+    float *d = dy.data + i*dy.cols;
+    float *x = dx.data + i*dx.cols;
+    int j, k;
+    if (l.layout == NHWC) {
+      for (j = 0; j < spatial; ++j) {
+        for (k = 0; k < c; ++k) x[j*c + k] = d[k]/spatial;
+      }
+    } else {
+      for (k = 0; k < c; ++k) {
+        float v = d[k]/spatial;
+        for (j = 0; j < spatial; ++j) x[k*spatial + j] = v;
+      }
+    }
+  }
+  return dx;
+}
+
+// Update average pool layer
+// Leave this blank since average pool layers have no update
+void update_avgpool_layer(layer l, float rate, float momentum, float decay){}
+
+// Make a new average pool layer
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels
+// int size: size of pooling window
+// int stride: stride of operation
+layer make_avgpool_layer(int w, int h, int c, int size, int stride)
+{
+    layer l = {0};
+    l.width = w;
+    l.height = h;
+    l.channels = c;
+    l.size = size;
+    l.stride = stride;
+    l.forward  = forward_avgpool_layer;
+    l.backward = backward_avgpool_layer;
+    l.update   = update_avgpool_layer;
+    return l;
+}
+
+// Make a new global average pool layer
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels, also the number of outputs
+layer make_global_avgpool_layer(int w, int h, int c)
+{
+    layer l = {0};
+    l.width = w;
+    l.height = h;
+    l.channels = c;
+    l.forward  = forward_global_avgpool_layer;
+    l.backward = backward_global_avgpool_layer;
+    l.update   = update_avgpool_layer;
+    return l;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include "uwnet.h"
 
 
@@ -65,34 +66,201 @@ matrix normalize(matrix x, matrix m, matrix v, int groups)
 }
 
 
+// View an NHWC batch as one (batch*spatial) x channels matrix
+// Each row of an NHWC batch is spatial x channels, so stacking them gives
+// a matrix whose groups are single columns, which the NCHW kernels above
+// already handle. NCHW matrices are returned unchanged.
+// layer l: batchnorm layer
+// matrix x: batch of inputs or deltas
+// returns: reshaped matrix sharing x's data
+matrix channels_last_view(layer l, matrix x)
+{
+    if(l.layout == NHWC){
+        x.rows = x.rows*x.cols/l.channels;
+        x.cols = l.channels;
+    }
+    return x;
+}
+
+// Sum (a - pa) and (a - pa)*(b - pb) over each group in one pass
+// Each group is reduced in float one contiguous run at a time and the
+// runs are added into doubles, so long batches keep their precision. A
+// group of n = 1 (channels last) is reduced across all groups at once.
+// matrix a, b: matrices of the same shape
+// int groups: number of groups
+// float *pa, *pb: per-group offsets
+// double *s1, *s2: outputs, per-group sums
+void group_moments(matrix a, float *pa, matrix b, float *pb, int groups, double *s1, double *s2)
+{
+    assert(a.cols % groups == 0);
+    int n = a.cols / groups;
+    int i, g, k;
+    if(n == 1){
+        float *t1 = calloc(2*groups, sizeof(float));
+        float *t2 = t1 + groups;
+        for(g = 0; g < groups; ++g) s1[g] = s2[g] = 0;
+        for(i = 0; i < a.rows; ++i){
+            float *ar = a.data + i*a.cols;
+            float *br = b.data + i*b.cols;
+            for(g = 0; g < groups; ++g){
+                float d = ar[g] - pa[g];
+                t1[g] += d;
+                t2[g] += d*(br[g] - pb[g]);
+            }
+            // Flush into the doubles every so often
+            if(i % 64 == 63 || i == a.rows-1){
+                for(g = 0; g < groups; ++g){
+                    s1[g] += t1[g];
+                    s2[g] += t2[g];
+                    t1[g] = t2[g] = 0;
+                }
+            }
+        }
+        free(t1);
+        return;
+    }
+    #pragma omp parallel for private(i, k)
+    for(g = 0; g < groups; ++g){
+        double d1 = 0, d2 = 0;
+        for(i = 0; i < a.rows; ++i){
+            float *ar = a.data + i*a.cols + g*n;
+            float *br = b.data + i*b.cols + g*n;
+            float oa = pa[g], ob = pb[g];
+            float t1 = 0, t2 = 0;
+            for(k = 0; k < n; ++k){
+                float d = ar[k] - oa;
+                t1 += d;
+                t2 += d*(br[k] - ob);
+            }
+            d1 += t1;
+            d2 += t2;
+        }
+        s1[g] = d1;
+        s2[g] = d2;
+    }
+}
+
+// Compute out = f(scale*x + shift) with per-group scale and shift
+// Each run of a group (or row of groups when n = 1) goes through the
+// activation while it is still in cache.
+// matrix x: input
+// float *scale, *shift: per-group factors
+// ACTIVATION a: activation f
+// matrix out: output, same shape as x
+void group_affine(matrix x, float *scale, float *shift, int groups, ACTIVATION a, matrix out)
+{
+    int n = x.cols / groups;
+    int i, g, k;
+    if(n == 1){
+        #pragma omp parallel for private(g)
+        for(i = 0; i < x.rows; ++i){
+            float *xr = x.data + i*x.cols;
+            float *yr = out.data + i*out.cols;
+            for(g = 0; g < groups; ++g) yr[g] = scale[g]*xr[g] + shift[g];
+            activate_array(yr, groups, a);
+        }
+        return;
+    }
+    #pragma omp parallel for collapse(2) private(k)
+    for(i = 0; i < x.rows; ++i){
+        for(g = 0; g < groups; ++g){
+            float *xr = x.data + i*x.cols + g*n;
+            float *yr = out.data + i*out.cols + g*n;
+            float sc = scale[g], sh = shift[g];
+            for(k = 0; k < n; ++k) yr[k] = sc*xr[k] + sh;
+            activate_array(yr, n, a);
+        }
+    }
+}
+
+// Get dL/dz for one run of a batchnorm layer's normalized output z
+// dz = dy*f'(z), where z = (x - m)*rstd is recomputed from the input
+// rather than saved. Without an activation dz is just dy.
+// layer l: batchnorm layer
+// float *x, *dy: run of the layer's input and dL/dy
+// float *m, *rstd: mean and 1/std, one per element if step is 1 or one
+// for the whole run if step is 0
+// int len: run length
+// float *z, *dz: len floats of scratch each
+// returns: dL/dz for the run
+float *batchnorm_delta_run(layer l, float *x, float *dy, float *m, float *rstd, int step, int len, float *z, float *dz)
+{
+    int k;
+    if(l.activation == LINEAR) return dy;
+    if(step){
+        for(k = 0; k < len; ++k) z[k] = (x[k] - m[k])*rstd[k];
+    } else {
+        float mk = *m, rk = *rstd;
+        for(k = 0; k < len; ++k) z[k] = (x[k] - mk)*rk;
+    }
+    memcpy(dz, dy, len*sizeof(float));
+    gradient_array(z, len, l.activation, dz);
+    return dz;
+}
+
 // Run an batchnorm layer on input
+// In TRAIN mode the batch mean and 1/sqrt(variance + epsilon) of each
+// channel are cached on the layer so backward doesn't recompute them,
+// and folded into the rolling statistics. EVAL and INFERENCE normalize
+// with the rolling statistics and leave the layer untouched.
 // layer l: pointer to layer to run
 // matrix x: input to layer
-// returns: the result of running the layer y = (x - mu) / sigma
+// returns: the result of running the layer y = f((x - mu) / sigma)
 matrix forward_batchnorm_layer(layer l, matrix x)
 {
     // Saving our input
     // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
-
-    if(x.rows == 1){
-        return normalize(x, l.rolling_mean, l.rolling_variance, l.channels);
+    if(l.mode == TRAIN){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(x);
     }
 
-    float s = 0.1;
-    matrix m = mean(x, l.channels);
-    matrix v = variance(x, m, l.channels);
-    matrix y = normalize(x, m, v, l.channels);
+    int c = l.channels;
+    int i;
+    matrix y = make_matrix_garbage(x.rows, x.cols);
+    float *scale = calloc(2*c, sizeof(float));
+    float *shift = scale + c;
+    float *m = l.batch_mean.data;
+    float *rstd = l.batch_rstd.data;
 
-    scal_matrix(1-s, l.rolling_mean);
-    axpy_matrix(s, m, l.rolling_mean);
-    scal_matrix(1-s, l.rolling_variance);
-    axpy_matrix(s, v, l.rolling_variance);
+    if(l.mode != TRAIN){
+        for(i = 0; i < c; ++i){
+            scale[i] = 1.f/sqrtf(l.rolling_variance.data[i] + EPS);
+            shift[i] = -l.rolling_mean.data[i]*scale[i];
+        }
+        group_affine(channels_last_view(l, x), scale, shift, c, l.activation, channels_last_view(l, y));
+        free(scale);
+        return y;
+    }
 
-    free_matrix(m);
-    free_matrix(v);
+    x = channels_last_view(l, x);
+    double *s1 = calloc(2*c, sizeof(double));
+    double *s2 = s1 + c;
+    // Moments are taken about each channel's first element, which keeps
+    // E[d^2] - E[d]^2 from cancelling when the mean is large
+    float *pivot = calloc(c, sizeof(float));
+    int n = x.cols / c;
+    for(i = 0; i < c; ++i) pivot[i] = x.data[i*n];
+    group_moments(x, pivot, x, pivot, c, s1, s2);
 
+    float s = 0.1;
+    double count = (double)x.rows*n;
+    for(i = 0; i < c; ++i){
+        double dm = s1[i]/count;
+        double v = s2[i]/count - dm*dm;
+        if(v < 0) v = 0;
+        m[i] = pivot[i] + dm;
+        rstd[i] = 1.f/sqrtf(v + EPS);
+        scale[i] = rstd[i];
+        shift[i] = -m[i]*rstd[i];
+        l.rolling_mean.data[i] = (1-s)*l.rolling_mean.data[i] + s*m[i];
+        l.rolling_variance.data[i] = (1-s)*l.rolling_variance.data[i] + s*v;
+    }
+    group_affine(x, scale, shift, c, l.activation, channels_last_view(l, y));
+
+    free(scale);
+    free(s1);
+    free(pivot);
     return y;
 }
 
@@ -156,25 +324,119 @@ matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matr
 
 
 // Run an batchnorm layer on input
+// With z = (x - m)*rstd and dz = dy*f'(z), dL/dx works out to
+// rstd*(dz - mean(dz) - z*mean(dz*z)), one per-channel affine function
+// of dz and x using the statistics cached by forward. dz is recomputed a
+// run at a time in both passes instead of being stored, and channels are
+// split across threads.
 // layer l: pointer to layer to run
 // matrix dy: derivative of loss wrt output, dL/dy
 // returns: derivative of loss wrt input, dL/dx
 matrix backward_batchnorm_layer(layer l, matrix dy)
 {
-    matrix x = *l.x;
+    matrix x = channels_last_view(l, *l.x);
+    matrix d = channels_last_view(l, dy);
+    int c = l.channels;
+    int n = x.cols / c;
+    int len = n == 1 ? c : n;
+    int i, g, k;
+    matrix dx = make_matrix_garbage(dy.rows, dy.cols);
+    matrix out = channels_last_view(l, dx);
+    float *m = l.batch_mean.data;
+    float *rstd = l.batch_rstd.data;
+    float *f = calloc(3*c, sizeof(float));
+    float *scale = f, *shift = f + c, *xscale = f + 2*c;
+    double *s1 = calloc(2*c, sizeof(double));
+    double *s2 = s1 + c;
 
-    matrix m = mean(x, l.channels);
-    matrix v = variance(x, m, l.channels);
+    // Sum dz and dz*(x - m) over each channel
+    if(n == 1){
+        float *t = calloc(4*c, sizeof(float));
+        float *t1 = t, *t2 = t + c, *z = t + 2*c, *dzs = t + 3*c;
+        for(i = 0; i < x.rows; ++i){
+            float *xr = x.data + i*x.cols;
+            float *dz = batchnorm_delta_run(l, xr, d.data + i*d.cols, m, rstd, 1, c, z, dzs);
+            for(g = 0; g < c; ++g){
+                t1[g] += dz[g];
+                t2[g] += dz[g]*(xr[g] - m[g]);
+            }
+            // Flush into the doubles every so often
+            if(i % 64 == 63 || i == x.rows-1){
+                for(g = 0; g < c; ++g){
+                    s1[g] += t1[g];
+                    s2[g] += t2[g];
+                    t1[g] = t2[g] = 0;
+                }
+            }
+        }
+        free(t);
+    } else {
+        #pragma omp parallel private(i, k)
+        {
+            float *z = calloc(2*n, sizeof(float));
+            float *dzs = z + n;
+            #pragma omp for
+            for(g = 0; g < c; ++g){
+                double d1 = 0, d2 = 0;
+                float mg = m[g];
+                for(i = 0; i < x.rows; ++i){
+                    float *xr = x.data + i*x.cols + g*n;
+                    float *dz = batchnorm_delta_run(l, xr, d.data + i*d.cols + g*n, m + g, rstd + g, 0, n, z, dzs);
+                    float t1 = 0, t2 = 0;
+                    for(k = 0; k < n; ++k){
+                        t1 += dz[k];
+                        t2 += dz[k]*(xr[k] - mg);
+                    }
+                    d1 += t1;
+                    d2 += t2;
+                }
+                s1[g] = d1;
+                s2[g] = d2;
+            }
+            free(z);
+        }
+    }
 
-    matrix dm = delta_mean(dy, v);
-    matrix dv = delta_variance(dy, x, m, v);
-    matrix dx = delta_batch_norm(dy, dm, dv, m, v, x);
+    double count = (double)x.rows*n;
+    for(g = 0; g < c; ++g){
+        float r = rstd[g];
+        float mdz = s1[g]/count;
+        float mdzx = s2[g]/count;
+        scale[g] = r;
+        xscale[g] = -r*r*r*mdzx;
+        shift[g] = -r*mdz - xscale[g]*m[g];
+    }
 
-    free_matrix(m);
-    free_matrix(v);
-    free_matrix(dm);
-    free_matrix(dv);
+    // dx = scale*dz + xscale*x + shift
+    #pragma omp parallel private(i, g, k)
+    {
+        float *z = calloc(2*len, sizeof(float));
+        float *dzs = z + len;
+        if(n == 1){
+            #pragma omp for
+            for(i = 0; i < x.rows; ++i){
+                float *xr = x.data + i*x.cols;
+                float *dxr = out.data + i*out.cols;
+                float *dz = batchnorm_delta_run(l, xr, d.data + i*d.cols, m, rstd, 1, c, z, dzs);
+                for(g = 0; g < c; ++g) dxr[g] = scale[g]*dz[g] + xscale[g]*xr[g] + shift[g];
+            }
+        } else {
+            #pragma omp for
+            for(g = 0; g < c; ++g){
+                float a = scale[g], b = xscale[g], sh = shift[g];
+                for(i = 0; i < x.rows; ++i){
+                    float *xr = x.data + i*x.cols + g*n;
+                    float *dxr = out.data + i*out.cols + g*n;
+                    float *dz = batchnorm_delta_run(l, xr, d.data + i*d.cols + g*n, m + g, rstd + g, 0, n, z, dzs);
+                    for(k = 0; k < n; ++k) dxr[k] = a*dz[k] + b*xr[k] + sh;
+                }
+            }
+        }
+        free(z);
+    }
 
+    free(f);
+    free(s1);
     return dx;
 }
 
@@ -185,14 +447,52 @@ matrix backward_batchnorm_layer(layer l, matrix dy)
 // float decay: l2 normalization term
 void update_batchnorm_layer(layer l, float rate, float momentum, float decay){}
 
+// Fold a batchnorm layer's rolling statistics into the layer before it
+// Each output channel k of l is scaled by r = 1/sqrt(var[k] + epsilon),
+// so l alone computes what l followed by bn does at inference.
+// layer l: convolutional, depthwise or connected layer, updated in place
+// layer bn: batchnorm layer on l's outputs
+void fold_batchnorm_layer(layer l, layer bn)
+{
+    int k, i;
+    // Connected weights are (inputs x outputs), conv weights are one
+    // filter per row
+    int per_column = l.forward == forward_connected_layer;
+    assert(l.b.cols == bn.channels);
+    for(k = 0; k < bn.channels; ++k){
+        float r = 1.f/sqrtf(bn.rolling_variance.data[k] + EPS);
+        l.b.data[k] = (l.b.data[k] - bn.rolling_mean.data[k])*r;
+        if(per_column){
+            for(i = 0; i < l.w.rows; ++i) l.w.data[i*l.w.cols + k] *= r;
+        } else {
+            for(i = 0; i < l.w.cols; ++i) l.w.data[k*l.w.cols + i] *= r;
+        }
+    }
+    refresh_space_to_depth_weights(l);
+}
+
 layer make_batchnorm_layer(int groups)
 {
+    return make_batchnorm_activation_layer(groups, LINEAR);
+}
+
+// Make a batchnorm layer followed by an activation
+// Normalizing and activating happen in the same pass, forward and
+// backward, instead of a separate activation layer's passes and copy.
+// int groups: number of channels or outputs to normalize
+// ACTIVATION a: activation to apply, not SOFTMAX
+layer make_batchnorm_activation_layer(int groups, ACTIVATION a)
+{
+    assert(a != SOFTMAX);
     layer l = {0};
     l.channels = groups;
+    l.activation = a;
     l.x = calloc(1, sizeof(matrix));
 
     l.rolling_mean = make_matrix(1, groups);
     l.rolling_variance = make_matrix(1, groups);
+    l.batch_mean = make_matrix(1, groups);
+    l.batch_rstd = make_matrix(1, groups);
 
     l.forward = forward_batchnorm_layer;
     l.backward = backward_batchnorm_layer;
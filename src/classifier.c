@@ -21,6 +21,7 @@ int max_index(float *a, int n)
 
 float accuracy_net(net m, data d)
 {
+    if (m.mode == TRAIN) m.mode = EVAL;
     matrix p = forward_net(m, d.x);
     int i;
     int correct = 0;
@@ -55,17 +56,67 @@ matrix cross_entropy_derivative(matrix x, matrix y)
     return d;
 }
 
+// Softmax followed by cross-entropy loss, fused, on logits x
+// Each row's softmax is computed stably (shifted by its max) straight
+// into dx. With lse = log(sum(e^x)), the loss is sum(y)*lse - sum(y*x):
+// a single log per row, and labels of 0 add nothing, so one-hot rows
+// only count their target. dL/dx is softmax(x) - y.
+// matrix x: logits, one row per example
+// matrix y: labels
+// matrix dx: output, dL/dx, same shape as x
+// returns: cross-entropy loss averaged over rows
+float softmax_cross_entropy(matrix x, matrix y, matrix dx)
+{
+    assert(x.rows == y.rows && x.cols == y.cols);
+    assert(dx.rows == x.rows && dx.cols == x.cols);
+    int i;
+    double loss = 0;
+    #pragma omp parallel for reduction(+:loss)
+    for(i = 0; i < x.rows; ++i){
+        float *xr = x.data + i*x.cols;
+        float *yr = y.data + i*y.cols;
+        float *d = dx.data + i*dx.cols;
+        int j;
+        float max = xr[0];
+        for(j = 1; j < x.cols; ++j) max = xr[j] > max ? xr[j] : max;
+        float sum = exp_shifted(xr, x.cols, max, d);
+        float lse = max + logf(sum);
+        float scale = 1/sum;
+        float ysum = 0, yx = 0;
+        for(j = 0; j < x.cols; ++j){
+            ysum += yr[j];
+            yx += yr[j]*xr[j];
+            d[j] = d[j]*scale - yr[j];
+        }
+        loss += ysum*lse - yx;
+    }
+    return loss/x.rows;
+}
+
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay)
 {
     srand(0);
     int e;
+    // A final softmax layer is fused into the loss, which then works on
+    // the logits of the layers before it
+    net body = m;
+    int fused = m.n > 0 && m.layers[m.n-1].forward == forward_activation_layer
+        && m.layers[m.n-1].activation == SOFTMAX;
+    if(fused) --body.n;
     for(e = 0; e < iters; ++e){
         data b = random_batch(d, batch);
-        matrix yhat = forward_net(m, b.x);
-        float err = cross_entropy_loss(yhat, b.y);
-        matrix dy = cross_entropy_derivative(yhat, b.y);
+        matrix yhat = forward_net(body, b.x);
+        float err;
+        matrix dy;
+        if(fused){
+            dy = make_matrix_garbage(yhat.rows, yhat.cols);
+            err = softmax_cross_entropy(yhat, b.y, dy);
+        } else {
+            err = cross_entropy_loss(yhat, b.y);
+            dy = cross_entropy_derivative(yhat, b.y);
+        }
         fprintf(stderr, "%06d: Loss: %f\n", e, err);
-        backward_net(m, dy);
+        backward_net(body, dy);
         update_net(m, rate/batch, momentum, decay);
         free_data(b);
         free_matrix(yhat);
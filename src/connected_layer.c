@@ -3,25 +3,6 @@
 #include <assert.h>
 #include "uwnet.h"
 
-// Add bias terms to a matrix
-// matrix xw: partially computed output of layer
-// matrix b: bias to add in (should only be one row!)
-// returns: y = wx + b
-matrix forward_bias(matrix xw, matrix b)
-{
-    assert(b.rows == 1);
-    assert(xw.cols == b.cols);
-
-    matrix y = copy_matrix(xw);
-    int i,j;
-    for(i = 0; i < xw.rows; ++i){
-        for(j = 0; j < xw.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j];
-        }
-    }
-    return y;
-}
-
 // Calculate dL/db from a dL/dy
 // matrix dy: derivative of loss wrt xw+b, dL/d(xw+b)
 // returns: derivative of loss wrt b, dL/db
@@ -45,18 +26,17 @@ matrix forward_connected_layer(layer l, matrix x)
 {
     // Saving our input
     // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
-
-    // TODO: 3.1 - run the network forward
-    // matrix y = make_matrix(x.rows, l.w.cols); // Going to want to change this!
-    matrix wx = matmul(x, l.w);
-    matrix y = forward_bias(wx, l.b);
-
-    free_matrix(wx);
-
-
+    if(l.mode == TRAIN){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(x);
+    }
 
+    // y = f(xw + b), with b and f applied as each row of y is finished
+    matrix y = make_matrix_garbage(x.rows, l.w.cols);
+    bias_activation ba = {l.b.data, 0, l.activation};
+    gemm_epilogue(0, 0, x.rows, l.w.cols, x.cols, 1, x.data, x.cols, l.w.data, l.w.cols, 0,
+            y.data, y.cols, bias_activation_epilogue, &ba);
+    save_activation_state(l, y);
     return y;
 }
 
@@ -67,6 +47,10 @@ matrix forward_connected_layer(layer l, matrix x)
 matrix backward_connected_layer(layer l, matrix dy)
 {
     matrix x = *l.x;
+    // With an activation, dy becomes dL/d(xw+b) from here on
+    int copied = l.activation != LINEAR && !l.in_place;
+    if(copied) dy = copy_matrix(dy);
+    activation_state_gradient(l, dy);
 
     // TODO: 3.2
     // Calculate the gradient dL/db for the bias terms using backward_bias
@@ -90,6 +74,7 @@ matrix backward_connected_layer(layer l, matrix dy)
     free_matrix(db);
     free_matrix(xt);
     free_matrix(wt);
+    if(copied) free_matrix(dy);
 
 
     return dx;
@@ -128,6 +113,7 @@ layer make_connected_layer(int inputs, int outputs)
     l.b  = make_matrix(1, outputs);
     l.db = make_matrix(1, outputs);
     l.x = calloc(1, sizeof(matrix));
+    l.activation_state = calloc(1, sizeof(unsigned char *));
     l.forward  = forward_connected_layer;
     l.backward = backward_connected_layer;
     l.update   = update_connected_layer;
@@ -2,43 +2,105 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "uwnet.h"
 
-// Add bias terms to a matrix
-// matrix xw: partially computed output of layer
+// Floats of dL/dy and columns one backward GEMM block works on, about
+// 256KB so a block stays in a per-core L2 cache
+#define CONV_BLOCK_FLOATS (64*1024)
+
+// Add bias terms to a matrix and activate it, in place
+// matrix y: partially computed output of layer, becomes f(y + b)
 // matrix b: bias to add in (should only be one row!)
-// returns: y = wx + b
-matrix forward_convolutional_bias(matrix xw, matrix b)
+// LAYOUT layout: layout of each row of y
+// ACTIVATION a: activation f
+void forward_convolutional_bias(matrix y, matrix b, LAYOUT layout, ACTIVATION a)
 {
     assert(b.rows == 1);
-    assert(xw.cols % b.cols == 0);
+    assert(y.cols % b.cols == 0);
 
-    matrix y = copy_matrix(xw);
-    int spatial = xw.cols / b.cols;
-    int i,j;
+    int spatial = y.cols / b.cols;
+    int i;
+    #pragma omp parallel for
     for(i = 0; i < y.rows; ++i){
-        for(j = 0; j < y.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j/spatial];
+        float *yr = y.data + i*y.cols;
+        int j, k;
+        if(layout == NHWC){
+            for(j = 0; j < spatial; ++j){
+                for(k = 0; k < b.cols; ++k) yr[j*b.cols + k] += b.data[k];
+            }
+        } else {
+            for(k = 0; k < b.cols; ++k){
+                for(j = 0; j < spatial; ++j) yr[k*spatial + j] += b.data[k];
+            }
         }
+        activate_array(yr, y.cols, a);
     }
-    return y;
 }
 
-// Calculate dL/db from a dL/dy
-// matrix dy: derivative of loss wrt xw+b, dL/d(xw+b)
-// returns: derivative of loss wrt b, dL/db
-matrix backward_convolutional_bias(matrix dy, int n)
+// Find the outputs of a strided 1-D window whose input index is in bounds
+// int n: input length
+// int outn: number of outputs
+// int offset: input index of output 0 (kernel tap offset minus padding)
+// int stride: stride of the window
+// int *start, *end: outputs [start, end) read input offset + o*stride < n
+void valid_range(int n, int outn, int offset, int stride, int *start, int *end)
+{
+  int s = offset < 0 ? (-offset + stride - 1)/stride : 0;
+  int e = n - offset > 0 ? (n - offset + stride - 1)/stride : 0;
+  if (e > outn) e = outn;
+  if (s > e) s = e;
+  *start = s;
+  *end = e;
+}
+
+// Unroll an image into a column buffer
+// Each (channel, kernel row, kernel col) is one output row. The outputs that
+// read inside the image are found once per kernel tap, so the interior is
+// filled with straight row copies (memcpy when stride is 1) and only the
+// padded border is zero filled.
+// float *data: CHW image data
+// int w, h, c: image dimensions
+// int size: kernel size for convolution operation. if 3x3 kernel, size=3
+// int stride: stride for convolution
+// int pad: padding before the first kernel tap, (size-1)/2*dilation for same padding
+// int dilation: spacing between kernel taps, 1 for a dense kernel
+// float *col: output, (c*size*size) rows of outw*outh columns each
+// int ldc: row stride of col, lets several images share one buffer
+SPECIALIZABLE void im2col_chw(float *data, int w, int h, int c, int size, int stride, int pad, int dilation, float *col, int ldc)
 {
-    assert(dy.cols % n == 0);
-    matrix db = make_matrix(1, n);
-    int spatial = dy.cols / n;
-    int i,j;
-    for(i = 0; i < dy.rows; ++i){
-        for(j = 0; j < dy.cols; ++j){
-            db.data[j/spatial] += dy.data[i*dy.cols + j];
+  int outw = (w-1)/stride + 1;
+  int outh = (h-1)/stride + 1;
+  int channel, ky, kx, oy, ox;
+
+  for (channel = 0; channel < c; ++channel) {
+    for (ky = 0; ky < size; ++ky) {
+      int y0, y1;
+      valid_range(h, outh, ky*dilation - pad, stride, &y0, &y1);
+      for (kx = 0; kx < size; ++kx) {
+        int x0, x1;
+        valid_range(w, outw, kx*dilation - pad, stride, &x0, &x1);
+        float *row = col + ((channel*size + ky)*size + kx)*ldc;
+
+        memset(row, 0, y0*outw*sizeof(float));
+        for (oy = y0; oy < y1; ++oy) {
+          float *out = row + oy*outw;
+          float *in = data + (channel*h + oy*stride + ky*dilation - pad)*w + kx*dilation - pad;
+          memset(out, 0, x0*sizeof(float));
+          if (stride == 1) {
+            memcpy(out + x0, in + x0, (x1 - x0)*sizeof(float));
+          } else {
+            for (ox = x0; ox < x1; ++ox) out[ox] = in[ox*stride];
+          }
+          memset(out + x1, 0, (outw - x1)*sizeof(float));
         }
+        memset(row + y1*outw, 0, (outh - y1)*outw*sizeof(float));
+      }
     }
-    return db;
+  }
 }
 
 // Make a column matrix out of an image
@@ -54,43 +116,115 @@ matrix im2col(image im, int size, int stride)
   int cols = outw * outh;
   matrix out = make_matrix_garbage(rows, cols);
 
-  // printf("image dimensions: %dx%dx%d\n", im.w,im.h,im.c);
-  // printf("output matrix dimensions: %dx%d\n", cols,rows);
-  // printf("kernel size: %dx%d\n", size,size);
-  // printf("outw, outh: %d, %d\n", outw, outh);
-  // printf("stride: %d\n", stride);
-
   // TODO: 5.1
   // Fill in the column matrix with patches from the image
-  for (int channel = 0; channel < im.c; channel++) {
-    int channel_img = im.w*im.h*channel;
-    int channel_output = channel*cols*size*size;
-    for (int kern_center_row = 0; kern_center_row < outh*stride; kern_center_row+=stride) {  // "center" row of kernel
-      for (int kern_center_col = 0; kern_center_col < outw*stride; kern_center_col+=stride) {  // "center" col of kernel
-        int col_output = kern_center_row*outw/stride + kern_center_col/stride;
-        for (int inner_kern_row = -(size-1)/2; inner_kern_row < size/2 + 1; inner_kern_row++) {  // offset row within kernel from center
-          int row_img = im.w*(kern_center_row + inner_kern_row);
-          int row_output_part1 = (inner_kern_row + (size-1)/2)*size;
-          for (int inner_kern_col = -(size-1)/2; inner_kern_col < size/2 + 1; inner_kern_col++) {  // offset col within kernel from center
-            int col_img = kern_center_col + inner_kern_col;
-            int row_output_part2 = (inner_kern_col + (size-1)/2);
-
-            int row_output = channel_output + (row_output_part1 + row_output_part2)*cols;
-
-            int img_pixel = channel_img + row_img + col_img;
-            int out_pixel = row_output + col_output;
-
-            out.data[out_pixel] =
-                (row_img < 0 || col_img < 0 || row_img / im.w >= im.h || col_img >= im.w) ?
-                0 :
-                im.data[img_pixel];
+  im2col_cpu(im.data, im.w, im.h, im.c, size, stride, 1, out.data, cols);
+
+  return out;
+}
+
+// The reverse of im2col_cpu, add elements of a column buffer into an image
+// Padded border elements are simply skipped, so only the valid interior
+// range of each kernel tap is visited.
+// float *col: column buffer, (c*size*size) rows with row stride ldc
+// int ldc: row stride of col
+// int w, h, c: image dimensions
+// int size: kernel size
+// int stride: convolution stride
+// int pad: padding before the first kernel tap
+// int dilation: spacing between kernel taps
+// float *data: CHW image data to add elements back into
+SPECIALIZABLE void col2im_chw(float *col, int ldc, int w, int h, int c, int size, int stride, int pad, int dilation, float *data)
+{
+  int outw = (w-1)/stride + 1;
+  int outh = (h-1)/stride + 1;
+  int channel, ky, kx, oy, ox;
+
+  for (channel = 0; channel < c; ++channel) {
+    for (ky = 0; ky < size; ++ky) {
+      int y0, y1;
+      valid_range(h, outh, ky*dilation - pad, stride, &y0, &y1);
+      for (kx = 0; kx < size; ++kx) {
+        int x0, x1;
+        valid_range(w, outw, kx*dilation - pad, stride, &x0, &x1);
+        float *row = col + ((channel*size + ky)*size + kx)*ldc;
+
+        for (oy = y0; oy < y1; ++oy) {
+          float *in = row + oy*outw;
+          float *out = data + (channel*h + oy*stride + ky*dilation - pad)*w + kx*dilation - pad;
+          if (stride == 1) {
+            for (ox = x0; ox < x1; ++ox) out[ox] += in[ox];
+          } else {
+            for (ox = x0; ox < x1; ++ox) out[ox*stride] += in[ox];
           }
         }
       }
     }
   }
+}
 
-  return out;
+// Generic im2col and col2im, size and stride are only known at run time
+void im2col_cpu(float *data, int w, int h, int c, int size, int stride, int dilation, float *col, int ldc)
+{
+  im2col_chw(data, w, h, c, size, stride, (size-1)/2*dilation, dilation, col, ldc);
+}
+
+void col2im_cpu(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, float *data)
+{
+  col2im_chw(col, ldc, w, h, c, size, stride, (size-1)/2*dilation, dilation, data);
+}
+
+// im2col and col2im compiled for a fixed size and stride, so the kernel
+// tap loops unroll and the strided copies get constant offsets. The size
+// and stride arguments are ignored.
+#define IM2COL_KERNELS(SIZE, STRIDE) \
+void im2col_##SIZE##x##SIZE##_s##STRIDE(float *data, int w, int h, int c, int size, int stride, int dilation, float *col, int ldc) \
+{ \
+  im2col_chw(data, w, h, c, SIZE, STRIDE, (SIZE-1)/2*dilation, dilation, col, ldc); \
+} \
+void col2im_##SIZE##x##SIZE##_s##STRIDE(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, float *data) \
+{ \
+  col2im_chw(col, ldc, w, h, c, SIZE, STRIDE, (SIZE-1)/2*dilation, dilation, data); \
+}
+
+IM2COL_KERNELS(1, 1)
+IM2COL_KERNELS(3, 1)
+IM2COL_KERNELS(3, 2)
+IM2COL_KERNELS(2, 2)
+
+// 2x2 stride 1 kernels with taps at offsets -1 and 0, what a 3x3 stride 2
+// convolution becomes after space-to-depth. Dilation must be 1.
+void im2col_2x2_s1_p1(float *data, int w, int h, int c, int size, int stride, int dilation, float *col, int ldc)
+{
+  im2col_chw(data, w, h, c, 2, 1, 1, 1, col, ldc);
+}
+
+void col2im_2x2_s1_p1(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, float *data)
+{
+  col2im_chw(col, ldc, w, h, c, 2, 1, 1, 1, data);
+}
+
+// Pick im2col and col2im kernels for a kernel size and stride
+// Falls back to the generic ones when there is no specialization.
+// int size, stride: kernel size and stride
+// im2col_kernel *im2col, col2im_kernel *col2im: the picked kernels
+void find_im2col_kernels(int size, int stride, im2col_kernel *im2col, col2im_kernel *col2im)
+{
+  *im2col = im2col_cpu;
+  *col2im = col2im_cpu;
+  if (size == 1 && stride == 1) {
+    *im2col = im2col_1x1_s1;
+    *col2im = col2im_1x1_s1;
+  } else if (size == 3 && stride == 1) {
+    *im2col = im2col_3x3_s1;
+    *col2im = col2im_3x3_s1;
+  } else if (size == 3 && stride == 2) {
+    *im2col = im2col_3x3_s2;
+    *col2im = col2im_3x3_s2;
+  } else if (size == 2 && stride == 2) {
+    *im2col = im2col_2x2_s2;
+    *col2im = col2im_2x2_s2;
+  }
 }
 
 // The reverse of im2col, add elements back into image
@@ -101,41 +235,808 @@ matrix im2col(image im, int size, int stride)
 image col2im(int width, int height, int channels, matrix col, int size, int stride)
 {
   image im = make_image(width, height, channels);
-  int outw = (im.w-1)/stride + 1;
-  int outh = (im.h-1)/stride + 1;
-  int rows = im.c*size*size;
-  int cols = outw * outh;
 
   // TODO: 5.2
   // Add values into image im from the column matrix
-  for (int channel = 0; channel < im.c; channel++) {
-    int channel_img = im.w*im.h*channel;
-    int channel_output = channel*cols*size*size;
-    for (int kern_center_row = 0; kern_center_row < outh*stride; kern_center_row+=stride) {  // "center" row of kernel
-      for (int kern_center_col = 0; kern_center_col < outw*stride; kern_center_col+=stride) {  // "center" col of kernel
-        int col_output = kern_center_row*outw/stride + kern_center_col/stride;
-        for (int inner_kern_row = -(size-1)/2; inner_kern_row < size/2 + 1; inner_kern_row++) {  // offset row within kernel from center
-          int row_img = im.w*(kern_center_row + inner_kern_row);
-          int row_output_part1 = (inner_kern_row + (size-1)/2)*size;
-          for (int inner_kern_col = -(size-1)/2; inner_kern_col < size/2 + 1; inner_kern_col++) {  // offset col within kernel from center
-            int col_img = kern_center_col + inner_kern_col;
-            int row_output_part2 = (inner_kern_col + (size-1)/2);
-
-            int row_output = channel_output + (row_output_part1 + row_output_part2)*cols;
-
-            int img_pixel = channel_img + row_img + col_img;
-            int out_pixel = row_output + col_output;
-
-            if (!(row_img < 0 || col_img < 0 || row_img / im.w >= im.h || col_img >= im.w)) {
-              im.data[img_pixel] += col.data[out_pixel];
+  col2im_cpu(col.data, col.cols, im.w, im.h, im.c, size, stride, 1, im.data);
+
+  return im;
+}
+
+// Unroll an HWC image into a column buffer with one row per output pixel
+// Each row holds the kernel window in (group, kernel row, kernel col,
+// channel) order, so every kernel tap is one contiguous copy of the
+// group's channels and each group's columns are one contiguous block.
+// float *data: HWC image data
+// int w, h, c: image dimensions
+// int size: kernel size
+// int stride: convolution stride
+// int dilation: spacing between kernel taps
+// int groups: number of channel groups
+// float *col: output, outw*outh rows of (size*size*c) columns each
+// int ldc: row stride of col
+void im2col_hwc_cpu(float *data, int w, int h, int c, int size, int stride, int dilation, int groups, float *col, int ldc)
+{
+  int outw = (w-1)/stride + 1;
+  int outh = (h-1)/stride + 1;
+  int pad = (size-1)/2*dilation;
+  int cg = c/groups;
+  int oy, ox, ky, kx, g;
+
+  for (oy = 0; oy < outh; ++oy) {
+    for (ox = 0; ox < outw; ++ox) {
+      float *row = col + (oy*outw + ox)*ldc;
+      for (ky = 0; ky < size; ++ky) {
+        int iy = oy*stride + ky*dilation - pad;
+        for (kx = 0; kx < size; ++kx) {
+          int ix = ox*stride + kx*dilation - pad;
+          int valid = !(iy < 0 || iy >= h || ix < 0 || ix >= w);
+          for (g = 0; g < groups; ++g) {
+            float *dst = row + ((g*size + ky)*size + kx)*cg;
+            if (valid) memcpy(dst, data + (iy*w + ix)*c + g*cg, cg*sizeof(float));
+            else       memset(dst, 0, cg*sizeof(float));
+          }
+        }
+      }
+    }
+  }
+}
+
+// The reverse of im2col_hwc_cpu, add a column buffer back into an HWC image
+// float *col: column buffer, outw*outh rows with row stride ldc
+// int ldc: row stride of col
+// int w, h, c: image dimensions
+// int size: kernel size
+// int stride: convolution stride
+// int dilation: spacing between kernel taps
+// int groups: number of channel groups
+// float *data: HWC image data to add elements back into
+void col2im_hwc_cpu(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, int groups, float *data)
+{
+  int outw = (w-1)/stride + 1;
+  int outh = (h-1)/stride + 1;
+  int pad = (size-1)/2*dilation;
+  int cg = c/groups;
+  int oy, ox, ky, kx, k, g;
+
+  for (oy = 0; oy < outh; ++oy) {
+    for (ox = 0; ox < outw; ++ox) {
+      float *row = col + (oy*outw + ox)*ldc;
+      for (ky = 0; ky < size; ++ky) {
+        int iy = oy*stride + ky*dilation - pad;
+        if (iy < 0 || iy >= h) continue;
+        for (kx = 0; kx < size; ++kx) {
+          int ix = ox*stride + kx*dilation - pad;
+          if (ix < 0 || ix >= w) continue;
+          for (g = 0; g < groups; ++g) {
+            float *src = row + ((g*size + ky)*size + kx)*cg;
+            float *dst = data + (iy*w + ix)*c + g*cg;
+            for (k = 0; k < cg; ++k) dst[k] += src[k];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Reorder convolutional weights from (channel, kernel row, kernel col)
+// to the (kernel row, kernel col, channel) order used by NHWC columns.
+// l.w keeps the NCHW order so weights don't depend on the layout.
+// layer l: layer whose weights to reorder
+// float *w: output, filters x (size*size*channels/groups)
+void hwc_weights(layer l, float *w)
+{
+  int kk = l.size*l.size;
+  int cg = l.channels/l.groups;
+  int f, c, k;
+  for (f = 0; f < l.w.rows; ++f) {
+    for (c = 0; c < cg; ++c) {
+      for (k = 0; k < kk; ++k) {
+        w[f*l.w.cols + k*cg + c] = l.w.data[f*l.w.cols + c*kk + k];
+      }
+    }
+  }
+}
+
+// Add a weight gradient in NHWC column order into l.dw (NCHW order)
+// float *dw: filters x (size*size*channels/groups) gradient from hwc columns
+// layer l: layer whose dw to accumulate into
+void add_hwc_weight_gradient(float *dw, layer l)
+{
+  int kk = l.size*l.size;
+  int cg = l.channels/l.groups;
+  int f, c, k;
+  for (f = 0; f < l.dw.rows; ++f) {
+    for (c = 0; c < cg; ++c) {
+      for (k = 0; k < kk; ++k) {
+        l.dw.data[f*l.dw.cols + c*kk + k] += dw[f*l.dw.cols + k*cg + c];
+      }
+    }
+  }
+}
+
+// Check whether a layer is a pointwise (1x1, stride 1) convolution.
+// For these, each example's CHW data is already the column matrix
+// im2col would build (channels x spatial), so we can skip im2col/col2im.
+// layer l: layer to check
+// returns: 1 if pointwise, 0 otherwise
+int is_pointwise_convolution(layer l)
+{
+  return l.size == 1 && l.stride == 1;
+}
+
+// Number of worker threads to split a batch of n examples across
+int convolutional_threads(int n)
+{
+  int t = 1;
+#ifdef _OPENMP
+  t = omp_get_max_threads();
+#endif
+  if(t > n) t = n;
+  return t > 0 ? t : 1;
+}
+
+// Index of the calling thread inside a parallel region
+int convolutional_thread()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Examples per block of the backward GEMMs
+// Each filter re-reads a block's columns, so a block is sized to keep its
+// dL/dy and columns in cache: batch-wide GEMMs stream them from memory
+// once per filter and run at half the speed.
+// layer l: layer to run
+// int spatial: outputs per example per filter
+// returns: number of examples, at least 1
+int backward_convolutional_block(layer l, int spatial)
+{
+    int rows = l.channels*l.size*l.size;
+    int block = CONV_BLOCK_FLOATS/((l.filters + rows)*spatial);
+    return block > 0 ? block : 1;
+}
+
+// Floats of workspace the im2col + GEMM paths need
+// Forward holds NHWC-ordered weights followed by one scratch column buffer
+// per thread. Backward holds NHWC-ordered weights, then for each thread
+// its private dL/dw and dL/db followed by the scratch its blocks need.
+// layer l: layer to run
+// int batch: number of examples
+// int backward: 0 for forward, 1 for backward
+// returns: number of floats
+int convolutional_workspace_size(layer l, int batch, int backward)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int spatial = outw*outh;
+  int rows = l.channels*l.size*l.size;
+  int threads = convolutional_threads(batch);
+  int hwc = l.layout == NHWC;
+  int pointwise = is_pointwise_convolution(l);
+  int wn = hwc ? l.w.rows*l.w.cols : 0;
+  if (!backward) {
+    int keep = l.keep_cols && !pointwise && l.mode == TRAIN;
+    int xn = (pointwise || keep) ? 0 : rows*spatial;
+    return wn + threads*xn;
+  }
+  int n = backward_convolutional_block(l, spatial)*spatial;
+  int gn = l.w.rows*l.w.cols + l.filters;
+  int sn = hwc ? (pointwise ? 0 : n*rows) : (l.filters + rows)*n;
+  return wn + threads*(gn + sn);
+}
+
+// Run a convolution forward as im2col + GEMM
+// The bias and activation are applied in the GEMM epilogue.
+// layer l: layer to run
+// matrix in: input to layer
+// float *ws: convolutional_workspace_size(l, in.rows, 0) floats of scratch
+// matrix out: output f(w*x + b), overwritten
+void forward_convolutional_gemm(layer l, matrix in, float *ws, matrix out)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int spatial = outw*outh;
+  int rows = l.channels*l.size*l.size;
+  int fg = l.filters/l.groups;
+  int wc = l.w.cols;
+  int pointwise = is_pointwise_convolution(l);
+  int hwc = l.layout == NHWC;
+  int keep = l.keep_cols && !pointwise && l.mode == TRAIN;
+  int threads = convolutional_threads(in.rows);
+
+  // Kept columns are laid out for the backward weight-gradient GEMM: NCHW
+  // puts examples side by side (rows x batch*spatial), NHWC stacks them
+  // ((batch*spatial) x rows), so any chunk of the batch is a sub-block
+  // Like the workspace, the buffer is only reallocated when a batch needs
+  // more room than any before it
+  if(keep){
+    int m = hwc ? in.rows*spatial : rows;
+    int n = hwc ? rows : in.rows*spatial;
+    if((size_t)l.cols->rows*l.cols->cols < (size_t)m*n){
+      free_matrix(*l.cols);
+      *l.cols = make_matrix_garbage(m, n);
+    }
+    l.cols->rows = m;
+    l.cols->cols = n;
+  }
+  int ldx = (keep && !hwc) ? in.rows*spatial : spatial;
+
+  int wn = hwc ? l.w.rows*l.w.cols : 0;
+  int xn = (pointwise || keep) ? 0 : rows*spatial;
+  float *w = hwc ? ws : l.w.data;
+  if(hwc) hwc_weights(l, w);
+
+  // Examples are independent, so split the batch across threads, each
+  // unrolling its examples into its own scratch column buffer
+  #pragma omp parallel num_threads(threads)
+  {
+    int i, g;
+    float *x = ws + wn + convolutional_thread()*xn;
+    #pragma omp for
+    for(i = 0; i < in.rows; ++i){
+      float *xi = in.data + i*in.cols;
+      float *yi = out.data + i*out.cols;
+      float *xc = keep ? l.cols->data + (hwc ? i*spatial*rows : i*spatial) : x;
+      // Each group of filters only sees its own block of cols
+      if(hwc){
+        // NHWC: y (spatial x filters) = cols (spatial x rows) * w^T
+        if(!pointwise){
+          im2col_hwc_cpu(xi, l.width, l.height, l.channels, l.size, l.stride, l.dilation, l.groups, xc, rows);
+          xi = xc;
+        }
+        for(g = 0; g < l.groups; ++g){
+          bias_activation ba = {l.b.data + g*fg, 0, l.activation};
+          gemm_epilogue(0, 1, spatial, fg, wc, 1, xi + g*wc, rows, w + g*fg*wc, wc, 0, yi + g*fg, l.filters,
+                        bias_activation_epilogue, &ba);
+        }
+      } else {
+        // NCHW: y (filters x spatial) = w * cols (rows x spatial)
+        int ld = spatial;
+        if(!pointwise){
+          l.im2col(xi, l.width, l.height, l.channels, l.size, l.stride, l.dilation, xc, ldx);
+          xi = xc;
+          ld = ldx;
+        }
+        for(g = 0; g < l.groups; ++g){
+          bias_activation ba = {l.b.data + g*fg, 1, l.activation};
+          gemm_epilogue(0, 0, fg, spatial, wc, 1, w + g*fg*wc, wc, xi + g*wc*ld, ld, 0, yi + g*fg*spatial, spatial,
+                        bias_activation_epilogue, &ba);
+        }
+      }
+    }
+  }
+}
+
+// Run a direct convolution forward on one CHW example, no im2col
+// Like the depthwise kernels, each (filter, channel, kernel tap) finds its
+// valid output range once and then runs contiguous row updates.
+// layer l: layer to run
+// float *in: input image
+// float *out: output image without biases, accumulated into
+void forward_convolutional_direct_chw(layer l, float *in, float *out)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2*l.dilation;
+  int cg = l.channels/l.groups;
+  int fg = l.filters/l.groups;
+  int f, c, ky, kx, oy, ox;
+  for (f = 0; f < l.filters; ++f) {
+    float *y = out + f*outw*outh;
+    for (c = 0; c < cg; ++c) {
+      float *x = in + (f/fg*cg + c)*l.width*l.height;
+      float *w = l.w.data + f*l.w.cols + c*l.size*l.size;
+      for (ky = 0; ky < l.size; ++ky) {
+        int y0, y1;
+        valid_range(l.height, outh, ky*l.dilation - pad, l.stride, &y0, &y1);
+        for (kx = 0; kx < l.size; ++kx) {
+          int x0, x1;
+          valid_range(l.width, outw, kx*l.dilation - pad, l.stride, &x0, &x1);
+          float wk = w[ky*l.size + kx];
+          for (oy = y0; oy < y1; ++oy) {
+            float *yr = y + oy*outw;
+            float *xr = x + (oy*l.stride + ky*l.dilation - pad)*l.width + kx*l.dilation - pad;
+            if (l.stride == 1) {
+              for (ox = x0; ox < x1; ++ox) yr[ox] += wk*xr[ox];
+            } else {
+              for (ox = x0; ox < x1; ++ox) yr[ox] += wk*xr[ox*l.stride];
             }
           }
         }
       }
     }
   }
+}
 
-  return im;
+// Run a direct convolution backward for one input channel over the batch
+// Input channel ch owns its rows of dL/dx and its columns of dL/dw, so
+// channels can run in parallel without private accumulators.
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy for the whole batch
+// int ch: input channel to run
+// matrix dx: dL/dx for the whole batch, accumulated into
+void backward_convolutional_direct_channel(layer l, matrix in, matrix dy, int ch, matrix dx)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2*l.dilation;
+  int cg = l.channels/l.groups;
+  int fg = l.filters/l.groups;
+  int c = ch%cg;
+  int i, f, ky, kx, oy, ox;
+  for (i = 0; i < in.rows; ++i) {
+    float *x = in.data + i*in.cols + ch*l.width*l.height;
+    float *dxc = dx.data + i*dx.cols + ch*l.width*l.height;
+    for (f = ch/cg*fg; f < (ch/cg + 1)*fg; ++f) {
+      float *d = dy.data + i*dy.cols + f*outw*outh;
+      float *w = l.w.data + f*l.w.cols + c*l.size*l.size;
+      float *dw = l.dw.data + f*l.dw.cols + c*l.size*l.size;
+      for (ky = 0; ky < l.size; ++ky) {
+        int y0, y1;
+        valid_range(l.height, outh, ky*l.dilation - pad, l.stride, &y0, &y1);
+        for (kx = 0; kx < l.size; ++kx) {
+          int x0, x1;
+          valid_range(l.width, outw, kx*l.dilation - pad, l.stride, &x0, &x1);
+          float wk = w[ky*l.size + kx];
+          float sum = 0;
+          for (oy = y0; oy < y1; ++oy) {
+            float *dr = d + oy*outw;
+            int offset = (oy*l.stride + ky*l.dilation - pad)*l.width + kx*l.dilation - pad;
+            float *xr = x + offset;
+            float *dxr = dxc + offset;
+            if (l.stride == 1) {
+              for (ox = x0; ox < x1; ++ox) {
+                sum += dr[ox]*xr[ox];
+                dxr[ox] += wk*dr[ox];
+              }
+            } else {
+              for (ox = x0; ox < x1; ++ox) {
+                sum += dr[ox]*xr[ox*l.stride];
+                dxr[ox*l.stride] += wk*dr[ox];
+              }
+            }
+          }
+          dw[ky*l.size + kx] += sum;
+        }
+      }
+    }
+  }
+}
+
+// Run a direct convolution forward, NCHW only
+// layer l: layer to run
+// matrix in: input to layer
+// matrix out: zeroed output, filled in without biases
+void forward_convolutional_direct(layer l, matrix in, matrix out)
+{
+  int i;
+  #pragma omp parallel for
+  for (i = 0; i < in.rows; ++i) {
+    forward_convolutional_direct_chw(l, in.data + i*in.cols, out.data + i*out.cols);
+  }
+}
+
+// Run a direct convolution backward, NCHW only
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy
+// matrix dx: zeroed dL/dx, filled in
+void backward_convolutional_direct(layer l, matrix in, matrix dy, matrix dx)
+{
+  int i, j, ch;
+  int spatial = dy.cols/l.filters;
+  for (i = 0; i < dy.rows; ++i) {
+    for (j = 0; j < dy.cols; ++j) {
+      l.db.data[j/spatial] += dy.data[i*dy.cols + j];
+    }
+  }
+  #pragma omp parallel for
+  for (ch = 0; ch < l.channels; ++ch) {
+    backward_convolutional_direct_channel(l, in, dy, ch, dx);
+  }
+}
+
+// Run a convolutional layer backward over examples [start, end) of a batch
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy for the whole batch
+// float *dw, *db: accumulators for this chunk's dL/dw and dL/db
+// float *scratch: (filters + rows) x block*spatial floats, see
+// backward_convolutional_block
+// matrix dx: dL/dx for the whole batch, rows [start, end) are filled in
+void backward_convolutional_chunk(layer l, matrix in, matrix dy, int start, int end, float *dw, float *db, float *scratch, matrix dx)
+{
+    int i, f, j, g, b;
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int spatial = outw*outh;
+    int block = backward_convolutional_block(l, spatial);
+    int fg = l.filters/l.groups;
+    int wc = l.w.cols;
+    int pointwise = is_pointwise_convolution(l);
+    int kept = l.keep_cols && !pointwise;
+    if(kept) assert(l.cols->cols == in.rows*spatial);
+
+    for(b = start; b < end; b += block){
+        int e = b + block < end ? b + block : end;
+        int n = (e - b)*spatial;
+        // Lay out the block side by side so the weight gradient is one
+        // GEMM reducing over examples*spatial: dL/dw = delta * cols^T, where
+        // delta is filters x (examples*spatial) and cols is rows x (examples*spatial).
+        // dL/db is reduced while we repack dy into delta.
+        float *delta = scratch;
+        float *cols = scratch + l.filters*n;
+        // Columns kept by forward hold the whole batch side by side
+        float *x = cols;
+        int ldx = n;
+        if(kept){
+            x = l.cols->data + b*spatial;
+            ldx = l.cols->cols;
+        }
+        for(i = b; i < e; ++i){
+            int offset = (i - b)*spatial;
+            for(f = 0; f < l.filters; ++f){
+                float *src = dy.data + i*dy.cols + f*spatial;
+                float *dst = delta + f*n + offset;
+                float sum = 0;
+                for(j = 0; j < spatial; ++j){
+                    dst[j] = src[j];
+                    sum += src[j];
+                }
+                db[f] += sum;
+            }
+            if(pointwise){
+                for(j = 0; j < l.channels; ++j){
+                    memcpy(cols + j*n + offset, in.data + i*in.cols + j*spatial, spatial*sizeof(float));
+                }
+            } else if(!kept){
+                l.im2col(in.data + i*in.cols, l.width, l.height, l.channels, l.size, l.stride, l.dilation, cols + offset, n);
+            }
+        }
+        for(g = 0; g < l.groups; ++g){
+            gemm(0, 1, fg, wc, n, 1, delta + g*fg*n, n, x + g*wc*ldx, ldx, 1, dw + g*fg*wc, wc);
+        }
+
+        // dL/dcols = w^T * delta, also for the whole block, into cols since
+        // kept columns must survive for another backward pass
+        for(g = 0; g < l.groups; ++g){
+            gemm(1, 0, wc, n, fg, 1, l.w.data + g*fg*wc, wc, delta + g*fg*n, n, 0, cols + g*wc*n, n);
+        }
+
+        for(i = b; i < e; ++i){
+            int offset = (i - b)*spatial;
+            if(pointwise){
+                // cols is already dL/dx in CHW order, no col2im needed
+                for(j = 0; j < l.channels; ++j){
+                    memcpy(dx.data + i*dx.cols + j*spatial, cols + j*n + offset, spatial*sizeof(float));
+                }
+            } else {
+                l.col2im(cols + offset, n, l.width, l.height, l.channels, l.size, l.stride, l.dilation, dx.data + i*dx.cols);
+            }
+        }
+    }
+}
+
+// Run an NHWC convolutional layer backward over examples [start, end)
+// In NHWC a block's dy is already a contiguous (examples*spatial) x filters
+// matrix, so no repacking is needed before the GEMMs.
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy for the whole batch
+// float *w: weights in NHWC column order, see hwc_weights
+// float *dw, *db: accumulators for this chunk's dL/dw (NHWC order) and dL/db
+// float *scratch: block*spatial x rows floats, unused for pointwise layers
+// matrix dx: dL/dx for the whole batch, rows [start, end) are filled in
+void backward_convolutional_chunk_hwc(layer l, matrix in, matrix dy, float *w, int start, int end, float *dw, float *db, float *scratch, matrix dx)
+{
+    int i, j, g, b;
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int spatial = outw*outh;
+    int block = backward_convolutional_block(l, spatial);
+    int rows = l.channels*l.size*l.size;
+    int fg = l.filters/l.groups;
+    int wc = l.w.cols;
+    int pointwise = is_pointwise_convolution(l);
+    int kept = l.keep_cols && !pointwise;
+    if(kept) assert(l.cols->rows == in.rows*spatial);
+
+    for(b = start; b < end; b += block){
+        int e = b + block < end ? b + block : end;
+        int n = (e - b)*spatial;
+        float *delta = dy.data + b*dy.cols;
+
+        for(i = 0; i < n; ++i){
+            for(j = 0; j < l.filters; ++j){
+                db[j] += delta[i*l.filters + j];
+            }
+        }
+
+        // Pointwise inputs already are the (examples*spatial) x channels columns
+        float *cols = in.data + b*in.cols;
+        if(kept){
+            cols = l.cols->data + b*spatial*rows;
+        } else if(!pointwise){
+            cols = scratch;
+            for(i = b; i < e; ++i){
+                im2col_hwc_cpu(in.data + i*in.cols, l.width, l.height, l.channels, l.size, l.stride, l.dilation, l.groups, cols + (i - b)*spatial*rows, rows);
+            }
+        }
+        // dL/dw = delta^T * cols, reducing over examples*spatial
+        for(g = 0; g < l.groups; ++g){
+            gemm(1, 0, fg, wc, n, 1, delta + g*fg, l.filters, cols + g*wc, rows, 1, dw + g*fg*wc, wc);
+        }
+
+        // dL/dcols = delta * w, for pointwise layers that is dL/dx itself
+        float *dcols = pointwise ? dx.data + b*dx.cols : scratch;
+        for(g = 0; g < l.groups; ++g){
+            gemm(0, 0, n, wc, fg, 1, delta + g*fg, l.filters, w + g*fg*wc, wc, 0, dcols + g*wc, rows);
+        }
+        if(pointwise) continue;
+        for(i = b; i < e; ++i){
+            col2im_hwc_cpu(dcols + (i - b)*spatial*rows, rows, l.width, l.height, l.channels, l.size, l.stride, l.dilation, l.groups, dx.data + i*dx.cols);
+        }
+    }
+}
+
+// Run a convolution backward as im2col + GEMM
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy
+// float *ws: convolutional_workspace_size(l, in.rows, 1) floats of scratch
+// matrix dx: zeroed dL/dx, filled in
+void backward_convolutional_gemm(layer l, matrix in, matrix dy, float *ws, matrix dx)
+{
+    int t, j, step;
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int rows = l.channels*l.size*l.size;
+    int threads = convolutional_threads(in.rows);
+    int hwc = l.layout == NHWC;
+    int pointwise = is_pointwise_convolution(l);
+
+    int n = backward_convolutional_block(l, outw*outh)*outw*outh;
+    int dwn = l.dw.rows*l.dw.cols;
+    int gn = dwn + l.db.cols;
+    int wn = hwc ? l.w.rows*l.w.cols : 0;
+    int sn = hwc ? (pointwise ? 0 : n*rows) : (l.filters + rows)*n;
+    float *w = hwc ? ws : l.w.data;
+    if(hwc) hwc_weights(l, w);
+
+    // Each thread takes a contiguous chunk of the batch and accumulates
+    // into private gradients, which are then summed pairwise in a tree
+    #pragma omp parallel for num_threads(threads)
+    for(t = 0; t < threads; ++t){
+        float *g = ws + wn + t*(gn + sn);
+        int start = in.rows*t/threads;
+        int end = in.rows*(t+1)/threads;
+        memset(g, 0, gn*sizeof(float));
+        if(hwc) backward_convolutional_chunk_hwc(l, in, dy, w, start, end, g, g + dwn, g + gn, dx);
+        else    backward_convolutional_chunk(l, in, dy, start, end, g, g + dwn, g + gn, dx);
+    }
+    for(step = 1; step < threads; step *= 2){
+        #pragma omp parallel for private(j) num_threads(threads)
+        for(t = 0; t < threads - step; t += 2*step){
+            float *a = ws + wn + t*(gn + sn);
+            float *b = a + step*(gn + sn);
+            for(j = 0; j < gn; ++j) a[j] += b[j];
+        }
+    }
+    float *g = ws + wn;
+    if(hwc){
+        add_hwc_weight_gradient(g, l);
+    } else {
+        for(j = 0; j < dwn; ++j) l.dw.data[j] += g[j];
+    }
+    for(j = 0; j < l.db.cols; ++j) l.db.data[j] += g[dwn + j];
+}
+
+// Space-to-depth runs a stride 2 convolution as a stride 1 one on a half
+// resolution image with 4x the channels, x'[c*4 + sy*2 + sx, Y, X] =
+// x[c, 2Y + sy, 2X + sx]. Tap ky of the original kernel lands on phase
+// (ky - pad) mod 2 at offset floor((ky - pad)/2), so every output reads a
+// dense window of x' and the stride 1 kernels apply.
+
+// Find the kernel a stride 2 convolution becomes after space-to-depth
+// layer l: stride 2 layer
+// int *size: size of the stride 1 kernel
+// int *pad: how far its first tap sits before the output pixel
+void space_to_depth_geometry(layer l, int *size, int *pad)
+{
+  int p = (l.size-1)/2;
+  int lo = (-p - 1)/2;
+  int hi = (l.size - 1 - p)/2;
+  *size = hi - lo + 1;
+  *pad = -lo;
+}
+
+// Reshuffle a batch of CHW images into space-to-depth order
+// matrix x: batch of w x h x c images
+// matrix s: output, batch of ceil(w/2) x ceil(h/2) x 4c images,
+// overwritten and zero past the edges
+void space_to_depth(matrix x, int w, int h, int c, matrix s)
+{
+  int sw = (w-1)/2 + 1;
+  int sh = (h-1)/2 + 1;
+  int i;
+  #pragma omp parallel for
+  for (i = 0; i < x.rows; ++i) {
+    int k, sy, sx, y, xx;
+    for (k = 0; k < c; ++k) {
+      for (sy = 0; sy < 2; ++sy) {
+        for (sx = 0; sx < 2; ++sx) {
+          float *dst = s.data + i*s.cols + (k*4 + sy*2 + sx)*sw*sh;
+          float *src = x.data + i*x.cols + k*w*h;
+          for (y = 0; y < sh; ++y) {
+            for (xx = 0; xx < sw; ++xx) {
+              int valid = 2*y + sy < h && 2*xx + sx < w;
+              dst[y*sw + xx] = valid ? src[(2*y + sy)*w + 2*xx + sx] : 0;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// The reverse of space_to_depth, add a space-to-depth batch into CHW images
+// matrix s: batch in space-to-depth order
+// int w, h, c: dimensions of the CHW images
+// matrix x: batch of CHW images to add into
+void depth_to_space(matrix s, int w, int h, int c, matrix x)
+{
+  int sw = (w-1)/2 + 1;
+  int sh = (h-1)/2 + 1;
+  int i;
+  #pragma omp parallel for
+  for (i = 0; i < x.rows; ++i) {
+    int k, sy, sx, y, xx;
+    for (k = 0; k < c; ++k) {
+      for (sy = 0; sy < 2; ++sy) {
+        for (sx = 0; sx < 2; ++sx) {
+          float *src = s.data + i*s.cols + (k*4 + sy*2 + sx)*sw*sh;
+          float *dst = x.data + i*x.cols + k*w*h;
+          for (y = 0; 2*y + sy < h; ++y) {
+            for (xx = 0; 2*xx + sx < w; ++xx) {
+              dst[(2*y + sy)*w + 2*xx + sx] += src[y*sw + xx];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Walk the weights of a stride 2 layer and its space-to-depth layer
+// together, copying l.w into s.w or adding s.dw into l.dw
+// layer l: stride 2 layer
+// layer s: its space-to-depth layer, see space_to_depth_layer
+// int gradient: 0 to repack weights, 1 to fold weight gradients back
+void space_to_depth_weights(layer l, layer s, int gradient)
+{
+  int p = (l.size-1)/2;
+  int cg = l.channels/l.groups;
+  int size, pad;
+  int f, c, sy, sx, a, b;
+  space_to_depth_geometry(l, &size, &pad);
+  for (f = 0; f < l.filters; ++f) {
+    for (c = 0; c < cg; ++c) {
+      for (sy = 0; sy < 2; ++sy) {
+        for (sx = 0; sx < 2; ++sx) {
+          for (a = 0; a < s.size; ++a) {
+            int ky = 2*(a - pad) + sy + p;
+            if (ky < 0 || ky >= l.size) continue;
+            for (b = 0; b < s.size; ++b) {
+              int kx = 2*(b - pad) + sx + p;
+              if (kx < 0 || kx >= l.size) continue;
+              int i = f*l.w.cols + (c*l.size + ky)*l.size + kx;
+              int j = f*s.w.cols + ((c*4 + sy*2 + sx)*s.size + a)*s.size + b;
+              if (gradient) l.dw.data[i] += s.dw.data[j];
+              else s.w.data[j] = l.w.data[i];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Make the stride 1 layer a stride 2 layer runs as after space-to-depth
+// It shares biases, bias gradients and the workspace with l. Its weights
+// are l.space_to_depth_w, packed from l.w the first time and refreshed
+// by refresh_space_to_depth_weights whenever l.w changes. Only backward
+// needs weight gradients, it gives s its own dw.
+// layer l: stride 2 layer
+// returns: the space-to-depth layer
+layer space_to_depth_layer(layer l)
+{
+  int size, pad;
+  space_to_depth_geometry(l, &size, &pad);
+  layer s = l;
+  s.width = (l.width-1)/2 + 1;
+  s.height = (l.height-1)/2 + 1;
+  s.channels = 4*l.channels;
+  s.size = size;
+  s.stride = 1;
+  s.dw = (matrix){0};
+  if (!l.space_to_depth_w->data) {
+    // Taps past the original kernel stay zero
+    *l.space_to_depth_w = make_matrix(l.filters, s.channels/l.groups*size*size);
+    s.w = *l.space_to_depth_w;
+    space_to_depth_weights(l, s, 0);
+  }
+  s.w = *l.space_to_depth_w;
+  if (pad == (size-1)/2) {
+    find_im2col_kernels(size, 1, &s.im2col, &s.col2im);
+  } else {
+    s.im2col = im2col_2x2_s1_p1;
+    s.col2im = col2im_2x2_s1_p1;
+  }
+  return s;
+}
+
+// Repack a layer's space-to-depth weights after its weights changed
+// Does nothing for layers that never ran through space-to-depth.
+// layer l: layer whose l.w changed
+void refresh_space_to_depth_weights(layer l)
+{
+  if (!l.space_to_depth_w || !l.space_to_depth_w->data) return;
+  space_to_depth_weights(l, space_to_depth_layer(l), 0);
+}
+
+// Run a stride 2 convolution forward through space-to-depth
+// The rearranged input lives at the front of the workspace, followed by
+// the stride 1 layer's GEMM scratch.
+// layer l: layer to run
+// matrix in: input to layer
+// matrix out: output f(w*x + b), overwritten
+void forward_convolutional_space_to_depth(layer l, matrix in, matrix out)
+{
+  layer s = space_to_depth_layer(l);
+  int xn = in.rows*s.width*s.height*s.channels;
+  float *ws = layer_workspace(l, xn + convolutional_workspace_size(s, in.rows, 0));
+  matrix x = {in.rows, s.width*s.height*s.channels, ws, 1};
+  space_to_depth(in, l.width, l.height, l.channels, x);
+  forward_convolutional_gemm(s, x, ws + xn, out);
+}
+
+// Run a stride 2 convolution backward through space-to-depth
+// The workspace holds the rearranged input, its dL/dx and the stride 1
+// layer's dL/dw, followed by its GEMM scratch.
+// layer l: layer to run
+// matrix in, dy: layer input and dL/dy
+// matrix dx: zeroed dL/dx, filled in
+void backward_convolutional_space_to_depth(layer l, matrix in, matrix dy, matrix dx)
+{
+  layer s = space_to_depth_layer(l);
+  int xn = in.rows*s.width*s.height*s.channels;
+  int wn = s.w.rows*s.w.cols;
+  float *ws = layer_workspace(l, 2*xn + wn + convolutional_workspace_size(s, in.rows, 1));
+  matrix x = {in.rows, s.width*s.height*s.channels, ws, 1};
+  matrix dxs = {in.rows, x.cols, ws + xn, 1};
+  s.dw = (matrix){s.w.rows, s.w.cols, ws + 2*xn, 1};
+  space_to_depth(in, l.width, l.height, l.channels, x);
+  memset(dxs.data, 0, (xn + wn)*sizeof(float));
+  backward_convolutional_gemm(s, x, dy, ws + 2*xn + wn, dxs);
+  space_to_depth_weights(l, s, 1);
+  depth_to_space(dxs, l.width, l.height, l.channels, dx);
+}
+
+// Check whether an algorithm can run a layer
+// layer l: layer to check
+// CONV_ALGORITHM a: algorithm to check
+// returns: 1 if it can, 0 otherwise
+int convolution_algorithm_eligible(layer l, CONV_ALGORITHM a)
+{
+  if (a == CONV_GEMM) return 1;
+  if (a == CONV_DIRECT) return l.layout == NCHW;
+  if (a == CONV_SPACE_TO_DEPTH) {
+    int size, pad;
+    space_to_depth_geometry(l, &size, &pad);
+    return l.layout == NCHW && l.stride == 2 && l.dilation == 1 && l.size > 1 &&
+           (pad == (size-1)/2 || (size == 2 && pad == 1));
+  }
+  return 0;
 }
 
 // Run a convolutional layer on input
@@ -147,27 +1048,25 @@ matrix forward_convolutional_layer(layer l, matrix in)
   assert(in.cols == l.width*l.height*l.channels);
   // Saving our input
   // Probably don't change this
-  free_matrix(*l.x);
-  *l.x = copy_matrix(in);
+  if (l.mode == TRAIN) {
+    free_matrix(*l.x);
+    *l.x = copy_matrix(in);
+  }
 
-  int i, j;
   int outw = (l.width-1)/l.stride + 1;
   int outh = (l.height-1)/l.stride + 1;
   matrix out = make_matrix(in.rows, outw*outh*l.filters);
-  for(i = 0; i < in.rows; ++i){
-    image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
-    matrix x = im2col(example, l.size, l.stride);
-    matrix wx = matmul(l.w, x);
-    for(j = 0; j < wx.rows*wx.cols; ++j){
-      out.data[i*out.cols + j] = wx.data[j];
-    }
-    free_matrix(x);
-    free_matrix(wx);
+  if (l.algorithm == CONV_DIRECT && convolution_algorithm_eligible(l, CONV_DIRECT)) {
+    forward_convolutional_direct(l, in, out);
+    forward_convolutional_bias(out, l.b, l.layout, l.activation);
+  } else if (l.algorithm == CONV_SPACE_TO_DEPTH && convolution_algorithm_eligible(l, CONV_SPACE_TO_DEPTH)) {
+    forward_convolutional_space_to_depth(l, in, out);
+  } else {
+    forward_convolutional_gemm(l, in, layer_workspace(l, convolutional_workspace_size(l, in.rows, 0)), out);
   }
-  matrix y = forward_convolutional_bias(out, l.b);
-  free_matrix(out);
+  save_activation_state(l, out);
 
-  return y;
+  return out;
 }
 
 // Run a convolutional layer backward
@@ -178,46 +1077,158 @@ matrix backward_convolutional_layer(layer l, matrix dy)
 {
     matrix in = *l.x;
     assert(in.cols == l.width*l.height*l.channels);
-
-    int i;
-    int outw = (l.width-1)/l.stride + 1;
-    int outh = (l.height-1)/l.stride + 1;
-
-
-    matrix db = backward_convolutional_bias(dy, l.db.cols);
-    axpy_matrix(1, db, l.db);
-    free_matrix(db);
-
+    // With an activation, dy becomes dL/d(w*x + b) from here on
+    int copied = l.activation != LINEAR && !l.in_place;
+    if(copied) dy = copy_matrix(dy);
+    activation_state_gradient(l, dy);
 
     matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
-    matrix wt = transpose_matrix(l.w);
+    if(l.algorithm == CONV_DIRECT && convolution_algorithm_eligible(l, CONV_DIRECT)){
+        backward_convolutional_direct(l, in, dy, dx);
+    } else if(l.algorithm == CONV_SPACE_TO_DEPTH && convolution_algorithm_eligible(l, CONV_SPACE_TO_DEPTH)){
+        backward_convolutional_space_to_depth(l, in, dy, dx);
+    } else {
+        backward_convolutional_gemm(l, in, dy, layer_workspace(l, convolutional_workspace_size(l, in.rows, 1)), dx);
+    }
+    if(copied) free_matrix(dy);
+    return dx;
+}
 
-    for(i = 0; i < in.rows; ++i){
-        image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
+// File that algorithm choices are cached in, none by default
+static char *convolution_cache = 0;
 
-        dy.rows = l.filters;
-        dy.cols = outw*outh;
+// Set the file convolution algorithm choices are read from and saved to
+// char *filename: cache file, 0 to turn caching off
+void set_convolution_cache(char *filename)
+{
+    free(convolution_cache);
+    convolution_cache = 0;
+    if(filename){
+        convolution_cache = malloc(strlen(filename) + 1);
+        strcpy(convolution_cache, filename);
+    }
+}
 
-        matrix x = im2col(example, l.size, l.stride);
-        matrix xt = transpose_matrix(x);
-        matrix dw = matmul(dy, xt);
-        axpy_matrix(1, dw, l.dw);
+// Look up a layer's algorithm in the cache file
+// Each line is: w h c filters size stride groups dilation layout batch algorithm
+// layer l: layer to look up
+// int batch: batch size the choice was made for
+// returns: cached algorithm, CONV_AUTO if there is none
+CONV_ALGORITHM cached_convolution_algorithm(layer l, int batch)
+{
+    CONV_ALGORITHM a = CONV_AUTO;
+    if(!convolution_cache) return a;
+    FILE *fp = fopen(convolution_cache, "r");
+    if(!fp) return a;
+    int k[11];
+    while(fscanf(fp, "%d %d %d %d %d %d %d %d %d %d %d", k, k+1, k+2, k+3, k+4, k+5, k+6, k+7, k+8, k+9, k+10) == 11){
+        if(k[0] == l.width && k[1] == l.height && k[2] == l.channels && k[3] == l.filters &&
+           k[4] == l.size && k[5] == l.stride && k[6] == l.groups && k[7] == l.dilation &&
+           k[8] == (int)l.layout && k[9] == batch && k[10] >= 0 && k[10] < CONV_AUTO){
+            a = k[10];
+        }
+    }
+    fclose(fp);
+    return a;
+}
 
-        matrix col = matmul(wt, dy);
-        image dxi = col2im(l.width, l.height, l.channels, col, l.size, l.stride);
-        memcpy(dx.data + i*dx.cols, dxi.data, dx.cols * sizeof(float));
-        free_matrix(col);
+// Append a layer's algorithm choice to the cache file
+// layer l: layer that was tuned
+// int batch: batch size it was tuned for
+// CONV_ALGORITHM a: the choice
+void save_convolution_algorithm(layer l, int batch, CONV_ALGORITHM a)
+{
+    if(!convolution_cache) return;
+    FILE *fp = fopen(convolution_cache, "a");
+    if(!fp){
+        fprintf(stderr, "Couldn't open convolution cache %s\n", convolution_cache);
+        return;
+    }
+    fprintf(fp, "%d %d %d %d %d %d %d %d %d %d %d\n", l.width, l.height, l.channels, l.filters,
+            l.size, l.stride, l.groups, l.dilation, l.layout, batch, a);
+    fclose(fp);
+}
 
-        free_matrix(x);
-        free_matrix(xt);
-        free_matrix(dw);
-        free_image(dxi);
+double convolution_time()
+{
+    struct timeval time;
+    if (gettimeofday(&time,NULL)){
+        return 0;
+    }
+    return (double)time.tv_sec + (double)time.tv_usec * .000001;
+}
+
+// Pick the fastest algorithm for a layer on a batch
+// Each eligible algorithm runs forward and backward (forward only outside
+// of TRAIN) on the batch, best of two so the first run's workspace
+// allocation doesn't count. The layer's gradients are restored afterwards,
+// and the choice is cached if a cache file is set.
+// layer l: layer to tune
+// matrix x: input batch in the layer's layout
+// returns: the fastest algorithm
+CONV_ALGORITHM tune_convolutional_layer(layer l, matrix x)
+{
+    CONV_ALGORITHM best = cached_convolution_algorithm(l, x.rows);
+    if(best != CONV_AUTO) return best;
 
-        dy.data = dy.data + dy.rows*dy.cols;
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int train = l.mode == TRAIN;
+    matrix dw = {0}, db = {0}, dy = {0};
+    if(train){
+        dw = copy_matrix(l.dw);
+        db = copy_matrix(l.db);
+        // Filled from a local generator: drawing from rand() here would
+        // change the batches training samples after tuning
+        unsigned int seed = 1;
+        int i;
+        dy = make_matrix_garbage(x.rows, outw*outh*l.filters);
+        for(i = 0; i < dy.rows*dy.cols; ++i){
+            seed = seed*1664525u + 1013904223u;
+            dy.data[i] = (seed >> 8)*(2.f/(1 << 24)) - 1;
+        }
     }
-    free_matrix(wt);
-    return dx;
+    double best_time = 0;
+    int a, r;
+    for(a = 0; a < CONV_AUTO; ++a){
+        if(!convolution_algorithm_eligible(l, a)) continue;
+        l.algorithm = a;
+        double t = 0;
+        for(r = 0; r < 2; ++r){
+            double start = convolution_time();
+            matrix y = l.forward(l, x);
+            if(train) free_matrix(l.backward(l, dy));
+            double elapsed = convolution_time() - start;
+            if(r == 0 || elapsed < t) t = elapsed;
+            free_matrix(y);
+        }
+        if(best == CONV_AUTO || t < best_time){
+            best = a;
+            best_time = t;
+        }
+    }
+    if(train){
+        memcpy(l.dw.data, dw.data, dw.rows*dw.cols*sizeof(float));
+        memcpy(l.db.data, db.data, db.rows*db.cols*sizeof(float));
+    }
+    free_matrix(dw);
+    free_matrix(db);
+    free_matrix(dy);
+    if(best != CONV_SPACE_TO_DEPTH){
+        free_matrix(*l.space_to_depth_w);
+        *l.space_to_depth_w = (matrix){0};
+    }
+    save_convolution_algorithm(l, x.rows, best);
+    return best;
+}
 
+// Name of a convolution algorithm, for reports
+char *convolution_algorithm_name(CONV_ALGORITHM a)
+{
+    if(a == CONV_GEMM) return "gemm";
+    if(a == CONV_DIRECT) return "direct";
+    if(a == CONV_SPACE_TO_DEPTH) return "space-to-depth";
+    return "auto";
 }
 
 // Update convolutional layer
@@ -237,16 +1248,24 @@ void update_convolutional_layer(layer l, float rate, float momentum, float decay
   // update biases
   axpy_matrix(-rate, l.db, l.b);
   scal_matrix(momentum, l.db);
+
+  refresh_space_to_depth_weights(l);
 }
 
-// Make a new convolutional layer
+// Make a new grouped convolutional layer
+// Channels and filters are split into groups, filters in group g only
+// see the channels in group g, so weights are filters x (size*size*c/groups)
 // int w: width of input image
 // int h: height of input image
 // int c: number of channels
+// int filters: number of filters
 // int size: size of convolutional filter to apply
 // int stride: stride of operation
-layer make_convolutional_layer(int w, int h, int c, int filters, int size, int stride)
+// int groups: number of groups, must divide c and filters
+layer make_grouped_convolutional_layer(int w, int h, int c, int filters, int size, int stride, int groups)
 {
+    assert(groups > 0 && c % groups == 0 && filters % groups == 0);
+    int inputs = size*size*c/groups;
     layer l = {0};
     l.width = w;
     l.height = h;
@@ -254,13 +1273,50 @@ layer make_convolutional_layer(int w, int h, int c, int filters, int size, int s
     l.filters = filters;
     l.size = size;
     l.stride = stride;
-    l.w  = random_matrix(filters, size*size*c, sqrtf(2.f/(size*size*c)));
-    l.dw = make_matrix(filters, size*size*c);
+    l.groups = groups;
+    l.dilation = 1;
+    l.algorithm = CONV_AUTO;
+    find_im2col_kernels(size, stride, &l.im2col, &l.col2im);
+    l.w  = random_matrix(filters, inputs, sqrtf(2.f/inputs));
+    l.dw = make_matrix(filters, inputs);
     l.b  = make_matrix(1, filters);
     l.db = make_matrix(1, filters);
     l.x = calloc(1, sizeof(matrix));
+    l.cols = calloc(1, sizeof(matrix));
+    l.workspace = calloc(1, sizeof(matrix));
+    l.space_to_depth_w = calloc(1, sizeof(matrix));
+    l.activation_state = calloc(1, sizeof(unsigned char *));
     l.forward  = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
     l.update   = update_convolutional_layer;
     return l;
 }
+
+// Make a new convolutional layer
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels
+// int size: size of convolutional filter to apply
+// int stride: stride of operation
+layer make_convolutional_layer(int w, int h, int c, int filters, int size, int stride)
+{
+    return make_grouped_convolutional_layer(w, h, c, filters, size, stride, 1);
+}
+
+// Make a new dilated convolutional layer
+// Kernel taps are spaced dilation pixels apart, so a size x size kernel
+// covers a (size-1)*dilation + 1 window at the cost of a size x size one
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels
+// int filters: number of filters
+// int size: size of convolutional filter to apply
+// int stride: stride of operation
+// int dilation: spacing between kernel taps
+layer make_dilated_convolutional_layer(int w, int h, int c, int filters, int size, int stride, int dilation)
+{
+    assert(dilation > 0);
+    layer l = make_convolutional_layer(w, h, c, filters, size, stride);
+    l.dilation = dilation;
+    return l;
+}
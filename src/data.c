@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <assert.h>
 #include "uwnet.h"
 #include "list.h"
 
@@ -126,6 +127,31 @@ char *fgetl(FILE *fp)
     return line;
 }
 
+// Reorder every row of a matrix of images between CHW and HWC
+// matrix x: one image per row, in layout from
+// int w, h, c: image dimensions
+// LAYOUT from, to: current and desired layout
+// returns: new matrix with the same images in layout to
+matrix convert_layout(matrix x, int w, int h, int c, LAYOUT from, LAYOUT to)
+{
+    assert(x.cols == w*h*c);
+    if(from == to) return copy_matrix(x);
+    matrix y = make_matrix(x.rows, x.cols);
+    int spatial = w*h;
+    int i, j, k;
+    for(i = 0; i < x.rows; ++i){
+        float *src = x.data + i*x.cols;
+        float *dst = y.data + i*y.cols;
+        for(k = 0; k < c; ++k){
+            for(j = 0; j < spatial; ++j){
+                if(to == NHWC) dst[j*c + k] = src[k*spatial + j];
+                else           dst[k*spatial + j] = src[j*c + k];
+            }
+        }
+    }
+    return y;
+}
+
 void free_data(data d)
 {
     free_matrix(d.x);
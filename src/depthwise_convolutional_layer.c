@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <string.h>
+#include "uwnet.h"
+
+// A depthwise convolution applies one size x size filter to each channel
+// separately, so there is no reduction over channels and im2col + GEMM
+// would mostly multiply zeros. These kernels work directly on the image:
+// for every kernel tap the valid output range is found once, and the
+// inner loops are branch-free contiguous row updates the compiler can
+// vectorize.
+//
+// Weights are stored as a (channels x size*size) matrix, one filter per row.
+
+// Run a depthwise convolution forward on one CHW example
+// float *in: input image
+// float *w, *b: weights and biases
+// float *out: output image, overwritten
+void forward_depthwise_chw(layer l, float *in, float *w, float *b, float *out)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int pad = (l.size-1)/2*l.dilation;
+    int c, ky, kx, oy, ox;
+    for(c = 0; c < l.channels; ++c){
+        float *y = out + c*outw*outh;
+        float *x = in + c*l.width*l.height;
+        for(ox = 0; ox < outw*outh; ++ox) y[ox] = b[c];
+        for(ky = 0; ky < l.size; ++ky){
+            int y0, y1;
+            valid_range(l.height, outh, ky*l.dilation - pad, l.stride, &y0, &y1);
+            for(kx = 0; kx < l.size; ++kx){
+                int x0, x1;
+                valid_range(l.width, outw, kx*l.dilation - pad, l.stride, &x0, &x1);
+                float wk = w[(c*l.size + ky)*l.size + kx];
+                for(oy = y0; oy < y1; ++oy){
+                    float *yr = y + oy*outw;
+                    float *xr = x + (oy*l.stride + ky*l.dilation - pad)*l.width + kx*l.dilation - pad;
+                    if(l.stride == 1){
+                        for(ox = x0; ox < x1; ++ox) yr[ox] += wk*xr[ox];
+                    } else {
+                        for(ox = x0; ox < x1; ++ox) yr[ox] += wk*xr[ox*l.stride];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Run a depthwise convolution backward on one channel of one CHW example
+// float *in: input image saved by forward
+// float *dy: dL/dy for the example
+// float *w: weights
+// float *dw: dL/dw accumulator
+// float *dx: dL/dx for the example, accumulated into
+// int c: channel to run
+void backward_depthwise_chw(layer l, float *in, float *dy, float *w, float *dw, float *dx, int c)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int pad = (l.size-1)/2*l.dilation;
+    int ky, kx, oy, ox;
+    float *d = dy + c*outw*outh;
+    float *x = in + c*l.width*l.height;
+    float *dxc = dx + c*l.width*l.height;
+    for(ky = 0; ky < l.size; ++ky){
+        int y0, y1;
+        valid_range(l.height, outh, ky*l.dilation - pad, l.stride, &y0, &y1);
+        for(kx = 0; kx < l.size; ++kx){
+            int x0, x1;
+            valid_range(l.width, outw, kx*l.dilation - pad, l.stride, &x0, &x1);
+            int k = (c*l.size + ky)*l.size + kx;
+            float wk = w[k];
+            float sum = 0;
+            for(oy = y0; oy < y1; ++oy){
+                float *dr = d + oy*outw;
+                int offset = (oy*l.stride + ky*l.dilation - pad)*l.width + kx*l.dilation - pad;
+                float *xr = x + offset;
+                float *dxr = dxc + offset;
+                if(l.stride == 1){
+                    for(ox = x0; ox < x1; ++ox){
+                        sum += dr[ox]*xr[ox];
+                        dxr[ox] += wk*dr[ox];
+                    }
+                } else {
+                    for(ox = x0; ox < x1; ++ox){
+                        sum += dr[ox]*xr[ox*l.stride];
+                        dxr[ox*l.stride] += wk*dr[ox];
+                    }
+                }
+            }
+            dw[k] += sum;
+        }
+    }
+}
+
+// Run a depthwise convolution forward on one HWC example
+// Channels are the contiguous inner loop, weights are (size*size x channels)
+// float *in: input image
+// float *w, *b: tap-major weights and biases
+// float *out: output image, overwritten
+void forward_depthwise_hwc(layer l, float *in, float *w, float *b, float *out)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int pad = (l.size-1)/2*l.dilation;
+    int c = l.channels;
+    int ky, kx, oy, ox, k;
+    for(oy = 0; oy < outh; ++oy){
+        for(ox = 0; ox < outw; ++ox){
+            float *y = out + (oy*outw + ox)*c;
+            memcpy(y, b, c*sizeof(float));
+            for(ky = 0; ky < l.size; ++ky){
+                int iy = oy*l.stride + ky*l.dilation - pad;
+                if(iy < 0 || iy >= l.height) continue;
+                for(kx = 0; kx < l.size; ++kx){
+                    int ix = ox*l.stride + kx*l.dilation - pad;
+                    if(ix < 0 || ix >= l.width) continue;
+                    float *x = in + (iy*l.width + ix)*c;
+                    float *wk = w + (ky*l.size + kx)*c;
+                    for(k = 0; k < c; ++k) y[k] += wk[k]*x[k];
+                }
+            }
+        }
+    }
+}
+
+// Run a depthwise convolution backward on one HWC example
+// float *in: input image saved by forward
+// float *dy: dL/dy for the example
+// float *w: tap-major weights
+// float *dw: tap-major dL/dw accumulator
+// float *dx: dL/dx for the example, accumulated into
+void backward_depthwise_hwc(layer l, float *in, float *dy, float *w, float *dw, float *dx)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int pad = (l.size-1)/2*l.dilation;
+    int c = l.channels;
+    int ky, kx, oy, ox, k;
+    for(oy = 0; oy < outh; ++oy){
+        for(ox = 0; ox < outw; ++ox){
+            float *d = dy + (oy*outw + ox)*c;
+            for(ky = 0; ky < l.size; ++ky){
+                int iy = oy*l.stride + ky*l.dilation - pad;
+                if(iy < 0 || iy >= l.height) continue;
+                for(kx = 0; kx < l.size; ++kx){
+                    int ix = ox*l.stride + kx*l.dilation - pad;
+                    if(ix < 0 || ix >= l.width) continue;
+                    float *x = in + (iy*l.width + ix)*c;
+                    float *dxp = dx + (iy*l.width + ix)*c;
+                    float *wk = w + (ky*l.size + kx)*c;
+                    float *dwk = dw + (ky*l.size + kx)*c;
+                    for(k = 0; k < c; ++k){
+                        dwk[k] += d[k]*x[k];
+                        dxp[k] += wk[k]*d[k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Copy the weights into w in the tap-major (size*size x channels) order
+// the HWC kernels read
+// layer l: layer whose weights to reorder
+// float *w: output
+void tap_major_weights(layer l, float *w)
+{
+    int i, k;
+    for(i = 0; i < l.w.rows; ++i){
+        for(k = 0; k < l.w.cols; ++k){
+            w[k*l.w.rows + i] = l.w.data[i*l.w.cols + k];
+        }
+    }
+}
+
+// Run a depthwise convolutional layer on input
+// layer l: pointer to layer to run
+// matrix in: input to layer
+// returns: the result of running the layer
+matrix forward_depthwise_convolutional_layer(layer l, matrix in)
+{
+    assert(in.cols == l.width*l.height*l.channels);
+    // Saving our input
+    // Probably don't change this
+    if(l.mode == TRAIN){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(in);
+    }
+
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int i;
+    int hwc = l.layout == NHWC;
+    float *w = l.w.data;
+    if(hwc){
+        w = layer_workspace(l, l.w.rows*l.w.cols);
+        tap_major_weights(l, w);
+    }
+    matrix out = make_matrix_garbage(in.rows, outw*outh*l.channels);
+
+    #pragma omp parallel for
+    for(i = 0; i < in.rows; ++i){
+        float *x = in.data + i*in.cols;
+        float *y = out.data + i*out.cols;
+        if(hwc) forward_depthwise_hwc(l, x, w, l.b.data, y);
+        else    forward_depthwise_chw(l, x, w, l.b.data, y);
+    }
+    return out;
+}
+
+// Run a depthwise convolutional layer backward
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+matrix backward_depthwise_convolutional_layer(layer l, matrix dy)
+{
+    matrix in = *l.x;
+    assert(in.cols == l.width*l.height*l.channels);
+
+    int i, j, t, step;
+    int hwc = l.layout == NHWC;
+    int spatial = dy.cols / l.channels;
+    int wn = l.w.rows*l.w.cols;
+    int threads = hwc ? convolutional_threads(dy.rows) : 1;
+    // The workspace holds the tap-major weights and, for HWC, a private
+    // tap-major dL/dw for each thread
+    float *w = l.w.data;
+    float *dw = l.dw.data;
+    if(hwc){
+        w = layer_workspace(l, (1 + threads)*wn);
+        dw = w + wn;
+        tap_major_weights(l, w);
+    }
+    matrix dx = make_matrix(dy.rows, in.cols);
+
+    for(i = 0; i < dy.rows; ++i){
+        for(j = 0; j < dy.cols; ++j){
+            l.db.data[hwc ? j%l.channels : j/spatial] += dy.data[i*dy.cols + j];
+        }
+    }
+    if(hwc){
+        // Channels are interleaved, so each thread takes a contiguous chunk
+        // of the batch and accumulates into its own dL/dw, then they are
+        // summed pairwise in a tree
+        #pragma omp parallel for private(i) num_threads(threads)
+        for(t = 0; t < threads; ++t){
+            float *dwt = dw + t*wn;
+            memset(dwt, 0, wn*sizeof(float));
+            for(i = dy.rows*t/threads; i < dy.rows*(t+1)/threads; ++i){
+                backward_depthwise_hwc(l, in.data + i*in.cols, dy.data + i*dy.cols, w, dwt, dx.data + i*dx.cols);
+            }
+        }
+        for(step = 1; step < threads; step *= 2){
+            #pragma omp parallel for private(j) num_threads(threads)
+            for(t = 0; t < threads - step; t += 2*step){
+                float *a = dw + t*wn;
+                float *b = a + step*wn;
+                for(j = 0; j < wn; ++j) a[j] += b[j];
+            }
+        }
+    } else {
+        // Channels are independent in both dL/dw and dL/dx, so split them
+        // across threads, walk the batch inside each and accumulate
+        // straight into l.dw
+        int c;
+        #pragma omp parallel for private(i)
+        for(c = 0; c < l.channels; ++c){
+            for(i = 0; i < dy.rows; ++i){
+                backward_depthwise_chw(l, in.data + i*in.cols, dy.data + i*dy.cols, w, dw, dx.data + i*dx.cols, c);
+            }
+        }
+    }
+    if(hwc){
+        for(i = 0; i < l.dw.rows; ++i){
+            for(j = 0; j < l.dw.cols; ++j){
+                l.dw.data[i*l.dw.cols + j] += dw[j*l.dw.rows + i];
+            }
+        }
+    }
+    return dx;
+}
+
+// Make a new depthwise convolutional layer
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels, also the number of filters
+// int size: size of each channel's filter
+// int stride: stride of operation
+layer make_depthwise_convolutional_layer(int w, int h, int c, int size, int stride)
+{
+    layer l = {0};
+    l.width = w;
+    l.height = h;
+    l.channels = c;
+    l.filters = c;
+    l.groups = c;
+    l.dilation = 1;
+    l.size = size;
+    l.stride = stride;
+    l.w  = random_matrix(c, size*size, sqrtf(2.f/(size*size)));
+    l.dw = make_matrix(c, size*size);
+    l.b  = make_matrix(1, c);
+    l.db = make_matrix(1, c);
+    l.x = calloc(1, sizeof(matrix));
+    l.workspace = calloc(1, sizeof(matrix));
+    l.forward  = forward_depthwise_convolutional_layer;
+    l.backward = backward_depthwise_convolutional_layer;
+    l.update   = update_convolutional_layer;
+    return l;
+}
@@ -57,6 +57,7 @@ void try_hw1()
     float decay = .0005;
 
     train_image_classifier(n, train, batch, iters, rate, momentum, decay);
+    print_convolution_algorithms(n);
     printf("Training accuracy: %f\n", accuracy_net(n, train));
     printf("Testing  accuracy: %f\n", accuracy_net(n, test));
     free_data(train);
@@ -67,13 +68,15 @@ void try_hw1()
 int main(int argc, char **argv)
 {
     if(argc < 2){
-        printf("usage: %s [test | tryhw0 | tryhw1]\n", argv[0]);  
+        printf("usage: %s [test | convspeed | tryhw0 | tryhw1]\n", argv[0]);  
     } else if (0 == strcmp(argv[1], "tryhw0")){
         try_hw0();
     } else if (0 == strcmp(argv[1], "tryhw1")){
         try_hw1();
     } else if (0 == strcmp(argv[1], "test")){
         run_tests();
+    } else if (0 == strcmp(argv[1], "convspeed")){
+        test_convolution_speed();
     }
     return 0;
 }
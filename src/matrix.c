@@ -118,6 +118,80 @@ matrix matmul(matrix a, matrix b)
     return c;
 }
 
+// Compute C = ALPHA*op(A)*op(B) + BETA*C on row-major float buffers and
+// run an epilogue on each row of C. Every loop finishes a row of C before
+// starting the next, so the epilogue sees each row while it is still in
+// cache and C is written once.
+// int TA, TB: if nonzero, op transposes A or B
+// int M, N, K: op(A) is M x K, op(B) is K x N, C is M x N
+// float *A, *B, *C: operands, with leading dimensions lda, ldb, ldc.
+// C must not overlap A or B
+// gemm_row_fn epilogue: run on each finished row, or 0 for none
+// void *arg: passed to epilogue
+void gemm_epilogue(int TA, int TB, int M, int N, int K, float ALPHA,
+        const float *restrict A, int lda,
+        const float *restrict B, int ldb,
+        float BETA,
+        float *C, int ldc,
+        gemm_row_fn epilogue, void *arg)
+{
+    int i, j, k;
+    for(i = 0; i < M; ++i){
+        float *restrict c = C + i*ldc;
+        if(BETA != 1){
+            for(j = 0; j < N; ++j){
+                // BETA == 0 overwrites C, so garbage in C never leaks through
+                c[j] = BETA ? BETA*c[j] : 0;
+            }
+        }
+        if(!TA && !TB){
+            for(k = 0; k < K; ++k){
+                float s = ALPHA*A[i*lda + k];
+                for(j = 0; j < N; ++j){
+                    c[j] += s*B[k*ldb + j];
+                }
+            }
+        } else if(!TA && TB){
+            for(j = 0; j < N; ++j){
+                float sum = 0;
+                for(k = 0; k < K; ++k){
+                    sum += A[i*lda + k]*B[j*ldb + k];
+                }
+                c[j] += ALPHA*sum;
+            }
+        } else if(TA && !TB){
+            for(k = 0; k < K; ++k){
+                float s = ALPHA*A[k*lda + i];
+                for(j = 0; j < N; ++j){
+                    c[j] += s*B[k*ldb + j];
+                }
+            }
+        } else {
+            for(j = 0; j < N; ++j){
+                float sum = 0;
+                for(k = 0; k < K; ++k){
+                    sum += A[k*lda + i]*B[j*ldb + k];
+                }
+                c[j] += ALPHA*sum;
+            }
+        }
+        if(epilogue) epilogue(c, i, N, arg);
+    }
+}
+
+// Compute C = ALPHA*op(A)*op(B) + BETA*C on row-major float buffers
+// int TA, TB: if nonzero, op transposes A or B
+// int M, N, K: op(A) is M x K, op(B) is K x N, C is M x N
+// float *A, *B, *C: operands, with leading dimensions lda, ldb, ldc
+void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc)
+{
+    gemm_epilogue(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc, 0, 0);
+}
+
 // In-place, element-wise scaling of matrix
 // float s: scaling factor
 // matrix m: matrix to be scaled
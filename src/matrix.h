@@ -50,6 +50,34 @@ matrix copy_matrix(matrix m);
 // returns: new matrix that is the result
 matrix matmul(matrix a, matrix b);
 
+// Compute C = ALPHA*op(A)*op(B) + BETA*C on raw row-major buffers
+// int TA, TB: if nonzero, op transposes A or B
+// int M, N, K: op(A) is M x K, op(B) is K x N, C is M x N
+// int lda, ldb, ldc: row strides of A, B and C
+void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+
+// Epilogue gemm_epilogue runs on each finished row of C
+// float *c: the row, n floats
+// int i: index of the row
+// int n: length of the row
+// void *arg: the caller's argument
+typedef void (*gemm_row_fn)(float *c, int i, int n, void *arg);
+
+// Compute C = ALPHA*op(A)*op(B) + BETA*C, then run epilogue on each row
+// of C while it is still in cache. Same arguments as gemm, plus
+// gemm_row_fn epilogue: run on each finished row, or 0 for none
+// void *arg: passed to epilogue
+void gemm_epilogue(int TA, int TB, int M, int N, int K, float ALPHA,
+        const float *restrict A, int lda,
+        const float *restrict B, int ldb,
+        float BETA,
+        float *C, int ldc,
+        gemm_row_fn epilogue, void *arg);
+
 // Perform the hammard product of two matrices (element-wise multiplication)
 // matrix a, b: operands
 // returns: result of hammard product
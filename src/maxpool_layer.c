@@ -2,126 +2,203 @@
 #include <math.h>
 #include <assert.h>
 #include <float.h>
+#include <string.h>
 #include "uwnet.h"
 
+// Maxpool one CHW plane
+// Windows start at -(size-1)/2 like convolutions, so outputs line up
+// with a same-padded conv of the same size and stride. A whole output row
+// is updated one window tap at a time: each tap's in-bounds output columns
+// are found once, so the border is simply skipped and the interior loop
+// is a branch-free compare and select across many columns, which the
+// compiler turns into SIMD. Taps run in window order with a strict >, so
+// ties go to the first max like a per-window scan.
+// float *in: input plane
+// int w, h: plane dimensions
+// int size, stride: window size and stride
+// float *out: window maxes, outw*outh
+// unsigned char *arg: window offset ky*size + kx of each window's max,
+// or 0 to skip recording them
+SPECIALIZABLE void maxpool_chw(float *in, int w, int h, int size, int stride, float *out, unsigned char *arg)
+{
+  int outw = (w-1)/stride + 1;
+  int outh = (h-1)/stride + 1;
+  int pad = (size-1)/2;
+  int x0[16], x1[16];
+  int oy, ox, ky, kx;
+  for (kx = 0; kx < size; ++kx) valid_range(w, outw, kx - pad, stride, x0 + kx, x1 + kx);
+  for (oy = 0; oy < outh; ++oy) {
+    float *y = out + oy*outw;
+    unsigned char *a = arg ? arg + oy*outw : 0;
+    for (ox = 0; ox < outw; ++ox) y[ox] = -FLT_MAX;
+    // The center tap is always in bounds
+    if (a) memset(a, pad*size + pad, outw);
+    for (ky = 0; ky < size; ++ky) {
+      int iy = oy*stride + ky - pad;
+      if (iy < 0 || iy >= h) continue;
+      for (kx = 0; kx < size; ++kx) {
+        float *x = in + iy*w + kx - pad;
+        unsigned char t = ky*size + kx;
+        if (!a) {
+          for (ox = x0[kx]; ox < x1[kx]; ++ox) {
+            float v = x[ox*stride];
+            y[ox] = v > y[ox] ? v : y[ox];
+          }
+          continue;
+        }
+        for (ox = x0[kx]; ox < x1[kx]; ++ox) {
+          float v = x[ox*stride];
+          int gt = v > y[ox];
+          y[ox] = gt ? v : y[ox];
+          a[ox] = gt ? t : a[ox];
+        }
+      }
+    }
+  }
+}
+
+// Generic maxpool, size and stride are only known at run time
+void maxpool_cpu(float *in, int w, int h, int size, int stride, float *out, unsigned char *arg)
+{
+  maxpool_chw(in, w, h, size, stride, out, arg);
+}
+
+// Maxpool compiled for a fixed size and stride so the window loops unroll,
+// the size and stride arguments are ignored
+#define MAXPOOL_KERNEL(SIZE, STRIDE) \
+void maxpool_##SIZE##x##SIZE##_s##STRIDE(float *in, int w, int h, int size, int stride, float *out, unsigned char *arg) \
+{ \
+  maxpool_chw(in, w, h, SIZE, STRIDE, out, arg); \
+}
+
+MAXPOOL_KERNEL(1, 1)
+MAXPOOL_KERNEL(3, 1)
+MAXPOOL_KERNEL(3, 2)
+MAXPOOL_KERNEL(2, 2)
+
+// Pick the maxpool kernel for a window size and stride
+// int size, stride: window size and stride
+// returns: a specialized kernel, or the generic one if there is none
+maxpool_kernel find_maxpool_kernel(int size, int stride)
+{
+  if (size == 1 && stride == 1) return maxpool_1x1_s1;
+  if (size == 3 && stride == 1) return maxpool_3x3_s1;
+  if (size == 3 && stride == 2) return maxpool_3x3_s2;
+  if (size == 2 && stride == 2) return maxpool_2x2_s2;
+  return maxpool_cpu;
+}
+
+// Run a maxpool layer on NHWC input
+// Channels are contiguous, so each window position updates the maxes of
+// all channels of an output pixel at once.
+// layer l: layer to run
+// matrix in: input to layer, NHWC
+// matrix out: window maxes, NHWC
+// unsigned char *arg: window offset of each max, laid out like out, or 0
+// to skip recording them
+void forward_maxpool_layer_hwc(layer l, matrix in, matrix out, unsigned char *arg)
+{
+  int outw = (l.width-1)/l.stride + 1;
+  int outh = (l.height-1)/l.stride + 1;
+  int pad = (l.size-1)/2;
+  int c = l.channels;
+  int i;
+
+  #pragma omp parallel for
+  for (i = 0; i < in.rows; ++i) {
+    int oy, ox, ky, kx, k;
+    for (oy = 0; oy < outh; ++oy) {
+      for (ox = 0; ox < outw; ++ox) {
+        float *y = out.data + i*out.cols + (oy*outw + ox)*c;
+        unsigned char *a = arg ? arg + i*out.cols + (oy*outw + ox)*c : 0;
+        for (k = 0; k < c; ++k) y[k] = -FLT_MAX;
+        if (a) memset(a, pad*l.size + pad, c);
+        for (ky = 0; ky < l.size; ++ky) {
+          int iy = oy*l.stride + ky - pad;
+          if (iy < 0 || iy >= l.height) continue;
+          for (kx = 0; kx < l.size; ++kx) {
+            int ix = ox*l.stride + kx - pad;
+            if (ix < 0 || ix >= l.width) continue;
+            float *x = in.data + i*in.cols + (iy*l.width + ix)*c;
+            unsigned char t = ky*l.size + kx;
+            if (!a) {
+              for (k = 0; k < c; ++k) y[k] = x[k] > y[k] ? x[k] : y[k];
+              continue;
+            }
+            for (k = 0; k < c; ++k) {
+              int gt = x[k] > y[k];
+              y[k] = gt ? x[k] : y[k];
+              a[k] = gt ? t : a[k];
+            }
+          }
+        }
+      }
+    }
+  }
+}
 
 // Run a maxpool layer on input
+// Instead of saving the input, forward records where each max came from
+// so backward is a single scatter. Only TRAIN records them.
 // layer l: pointer to layer to run
 // matrix in: input to layer
 // returns: the result of running the layer
 matrix forward_maxpool_layer(layer l, matrix in)
 {
-  // Saving our input
-  // Probably don't change this
-  free_matrix(*l.x);
-  *l.x = copy_matrix(in);
-
   int outw = (l.width-1)/l.stride + 1;
   int outh = (l.height-1)/l.stride + 1;
-  int size = l.size;
-  int stride = l.stride;
+  int planes = in.rows*l.channels;
+  int p;
   matrix out = make_matrix_garbage(in.rows, outw*outh*l.channels);
+  unsigned char *arg = 0;
+  if (l.mode == TRAIN) {
+    *l.argmax = realloc(*l.argmax, out.rows*out.cols*sizeof(unsigned char));
+    arg = *l.argmax;
+  }
 
-  // TODO: 6.1 - iterate over the input and fill in the output with max values
-  // printf("in dimensions: %d, %dx%dx%d\n", in.rows, l.width, l.height, l.channels);
-  // printf("out dimensions: %d, %dx%dx%d\n", out.rows, outw, outh, l.channels);
-  // printf("stride: %d\n", l.stride);
-  // printf("kernel size: %d\n", l.size);
-
-  for (int image_num = 0; image_num < in.rows; image_num++) {
-    int image_start_in = image_num * in.cols;
-    int image_start_out = image_num * out.cols;
-    for (int channel = 0; channel < l.channels; channel++) {
-      int channel_in = l.width*l.height*channel;
-      int channel_out = outw*outh*channel;
-      for (int kern_center_row = 0; kern_center_row < outh*stride; kern_center_row += stride) {
-        int row_out = kern_center_row*outw/stride;
-        for (int kern_center_col = 0; kern_center_col < outw*stride; kern_center_col+=stride) {
-          int col_out = kern_center_col/stride;
-          float max = FLT_MIN;
-          for (int inner_kern_row = -(size-1)/2; inner_kern_row < size/2 + 1; inner_kern_row++) {
-            int row_in = l.width*(kern_center_row + inner_kern_row);
-              for (int inner_kern_col = -(size-1)/2; inner_kern_col < size/2 + 1; inner_kern_col++) {
-                int col_in = kern_center_col + inner_kern_col;
-
-                int in_pixel = image_start_in + channel_in + row_in + col_in;
-                if (!(row_in < 0 || col_in < 0 || row_in / in.cols >= l.height || col_in >= l.width) &&
-                    in.data[in_pixel] > max) {
-                  max = in.data[in_pixel];
-                }
-              }
-          }
-          int out_pixel = image_start_out + channel_out + row_out + col_out;
-          out.data[out_pixel] = max;
-        }
-      }
-    }
+  if (l.layout == NHWC) {
+    forward_maxpool_layer_hwc(l, in, out, arg);
+    return out;
   }
 
+  // Every (example, channel) plane is pooled on its own
+  #pragma omp parallel for
+  for (p = 0; p < planes; ++p) {
+    l.maxpool(in.data + p*l.width*l.height, l.width, l.height, l.size, l.stride,
+              out.data + p*outw*outh, arg ? arg + p*outw*outh : 0);
+  }
   return out;
 }
 
 // Run a maxpool layer backward
+// Each output's delta goes to the input its forward max came from
 // layer l: layer to run
 // matrix dy: error term for the previous layer
 matrix backward_maxpool_layer(layer l, matrix dy)
 {
-  matrix in    = *l.x;
   matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
-
   int outw = (l.width-1)/l.stride + 1;
   int outh = (l.height-1)/l.stride + 1;
-  int size = l.size;
-  int stride = l.stride;
-
-  // printf("in dimensions: %d, %dx%dx%d\n", in.rows, l.width, l.height, l.channels);
-  // printf("dx dimensions: %d, %dx%dx%d\n", dx.rows, l.width, l.height, l.channels);
-  // printf("dy dimensions: %d, %dx%dx%d\n", dy.rows, outw, outh, l.channels);
-  // printf("stride: %d\n", l.stride);
-  // printf("kernel size: %d\n", l.size);
-
-  // TODO: 6.2 - find the max values in the input again and fill in the
-  // corresponding delta with the delta from the output. This should be
-  // similar to the forward method in structure.
-  for (int image_num = 0; image_num < in.rows; image_num++) {
-    int image_start_in = in.cols*image_num;
-    int image_start_dy = dy.cols*image_num;
-    for (int channel = 0; channel < l.channels; channel++) {
-      int channel_in = l.width*l.height*channel;
-      int channel_dy = outw*outh*channel;
-      for (int kern_center_row = 0; kern_center_row < outh*stride; kern_center_row += stride) {
-        int row_out = kern_center_row*outw/stride;
-        for (int kern_center_col = 0; kern_center_col < outw*stride; kern_center_col+=stride) {
-          int col_out = kern_center_col/stride;
-          float max = -FLT_MAX;
-          // printf("%f\n", max);
-          int max_row = -(size-1)/2 - 1;
-          int max_col = -(size-1)/2 - 1;
-          for (int inner_kern_row = -(size-1)/2; inner_kern_row < size/2 + 1; inner_kern_row++) {
-            int row_in = l.width*(kern_center_row + inner_kern_row);
-            for (int inner_kern_col = -(size-1)/2; inner_kern_col < size/2 + 1; inner_kern_col++) {
-              int col_in = kern_center_col + inner_kern_col;
-
-              int in_pixel = image_start_in + channel_in + row_in + col_in;
-
-              // printf("%d %d %d %d: %d \n", image_start_in , channel_in , row_in , col_in, in_pixel);
-              if (!(row_in < 0 || col_in < 0 || row_in / l.width >= l.height || col_in >= l.width)) {
-                if (in.data[in_pixel] > max) {
-                  // printf("WE out here2\n");
-                  max = in.data[in_pixel];
-                  max_row = inner_kern_row;
-                  max_col = inner_kern_col;
-                }
-              }
-            }
-          }
-          assert (max_row != -(size-1)/2 - 1);
-          assert (max_col != -(size-1)/2 - 1);
-
-          int dy_pixel = image_start_dy + channel_dy + row_out + col_out;
-          int dx_pixel = image_start_in + channel_in + l.width*(kern_center_row + max_row) + kern_center_col + max_col;
-          dx.data[dx_pixel] += dy.data[dy_pixel];
-        }
+  int pad = (l.size-1)/2;
+  int c = l.channels;
+  int hwc = l.layout == NHWC;
+  int p;
+  unsigned char *arg = *l.argmax;
+
+  // Each (example, channel) plane only scatters into its own inputs
+  #pragma omp parallel for
+  for (p = 0; p < dy.rows*c; ++p) {
+    int i = p/c;
+    int k = p%c;
+    int oy, ox;
+    for (oy = 0; oy < outh; ++oy) {
+      for (ox = 0; ox < outw; ++ox) {
+        int o = hwc ? (oy*outw + ox)*c + k : (k*outh + oy)*outw + ox;
+        int t = arg[i*dy.cols + o];
+        int iy = oy*l.stride + t/l.size - pad;
+        int ix = ox*l.stride + t%l.size - pad;
+        int index = hwc ? (iy*l.width + ix)*c + k : (k*l.height + iy)*l.width + ix;
+        dx.data[i*dx.cols + index] += dy.data[i*dy.cols + o];
       }
     }
   }
@@ -140,13 +217,16 @@ void update_maxpool_layer(layer l, float rate, float momentum, float decay){}
 // int stride: stride of operation
 layer make_maxpool_layer(int w, int h, int c, int size, int stride)
 {
+    // Argmax window offsets are stored in a byte
+    assert(size*size <= 256);
     layer l = {0};
     l.width = w;
     l.height = h;
     l.channels = c;
     l.size = size;
     l.stride = stride;
-    l.x = calloc(1, sizeof(matrix));
+    l.maxpool = find_maxpool_kernel(size, stride);
+    l.argmax = calloc(1, sizeof(unsigned char *));
     l.forward  = forward_maxpool_layer;
     l.backward = backward_maxpool_layer;
     l.update   = update_maxpool_layer;
@@ -1,16 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <assert.h>
 #include "uwnet.h"
 
 matrix forward_net(net m, matrix input)
 {
     int i;
-    matrix x = copy_matrix(input);
+    matrix x;
+    if (m.layout != NCHW && m.n && m.layers[0].width && m.layers[0].height) {
+        // The only layout conversion: inputs arrive as NCHW images
+        layer l = m.layers[0];
+        x = convert_layout(input, l.width, l.height, l.channels, NCHW, m.layout);
+    } else {
+        x = copy_matrix(input);
+    }
     for (i = 0; i < m.n; ++i) {
         layer l = m.layers[i];
+        l.layout = m.layout;
+        l.mode = m.mode;
+        // Lock in a CONV_AUTO layer's fastest algorithm on the first batch
+        // it trains on, or runs as part of an INFERENCE net. EVAL calls
+        // between training steps (often a single image) would time the
+        // wrong workload, so they run untuned layers as GEMM.
+        if (l.algorithm == CONV_AUTO && m.mode != EVAL) {
+            l.algorithm = m.layers[i].algorithm = tune_convolutional_layer(l, x);
+        }
+        l.in_place = 1;
         matrix y = l.forward(l, x);
 
-        free_matrix(x);
+        if (y.data != x.data) free_matrix(x);
         x = y;
     }
     return x;
@@ -18,13 +36,16 @@ matrix forward_net(net m, matrix input)
 
 void backward_net(net m, matrix d)
 {
+    assert(m.mode != INFERENCE);
     matrix dy = copy_matrix(d);
     int i;
     for (i = m.n-1; i >= 0; --i) {
         layer l = m.layers[i];
+        l.layout = m.layout;
+        l.in_place = 1;
         matrix dx = l.backward(l, dy);
 
-        free_matrix(dy);
+        if (dx.data != dy.data) free_matrix(dy);
         dy = dx;
     }
     free_matrix(dy);
@@ -32,6 +53,7 @@ void backward_net(net m, matrix d)
 
 void update_net(net m, float rate, float momentum, float decay)
 {
+    assert(m.mode != INFERENCE);
     int i;
     for(i = 0; i < m.n; ++i){
         layer l = m.layers[i];
@@ -45,10 +67,112 @@ void free_layer(layer l)
     free_matrix(l.dw);
     free_matrix(l.b);
     free_matrix(l.db);
+    free_matrix(l.rolling_mean);
+    free_matrix(l.rolling_variance);
+    free_matrix(l.batch_mean);
+    free_matrix(l.batch_rstd);
     if(l.x){
         free_matrix(*l.x);
         free(l.x);
     }
+    if(l.cols){
+        free_matrix(*l.cols);
+        free(l.cols);
+    }
+    if(l.workspace){
+        free_matrix(*l.workspace);
+        free(l.workspace);
+    }
+    if(l.space_to_depth_w){
+        free_matrix(*l.space_to_depth_w);
+        free(l.space_to_depth_w);
+    }
+    if(l.argmax){
+        free(*l.argmax);
+        free(l.argmax);
+    }
+    if(l.activation_state){
+        free(*l.activation_state);
+        free(l.activation_state);
+    }
+}
+
+// Free a matrix and leave an empty one in its place
+// matrix *m: matrix to release
+void release_matrix(matrix *m)
+{
+    free_matrix(*m);
+    *m = (matrix){0};
+}
+
+// Switch a net to INFERENCE: release every layer's gradients (which also
+// hold the momentum update_net carries between steps), batch statistics
+// and anything forward saved for backward, maxpool argmaxes included.
+// Forward passes then only touch weights, rolling statistics and scratch,
+// so a serving process holds about half the memory of a trainable net.
+// The net can't be trained afterwards, backward_net and update_net refuse
+// INFERENCE nets.
+// net n: net to switch, its layers are updated in place
+// returns: n in INFERENCE mode
+net inference_net(net n)
+{
+    int i;
+    for(i = 0; i < n.n; ++i){
+        layer *l = n.layers + i;
+        release_matrix(&l->dw);
+        release_matrix(&l->db);
+        release_matrix(&l->batch_mean);
+        release_matrix(&l->batch_rstd);
+        if(l->x) release_matrix(l->x);
+        if(l->cols) release_matrix(l->cols);
+        if(l->activation_state){
+            free(*l->activation_state);
+            *l->activation_state = 0;
+        }
+        if(l->argmax){
+            free(*l->argmax);
+            *l->argmax = 0;
+        }
+    }
+    n.mode = INFERENCE;
+    return n;
+}
+
+// Get a layer's workspace with room for at least n floats
+// It is only reallocated when a call needs more than any before it,
+// so after the first batch layers run without allocating scratch.
+// layer l: layer whose workspace to use
+// int n: number of floats needed
+// returns: workspace data, contents are garbage
+float *layer_workspace(layer l, int n)
+{
+    assert(l.workspace);
+    if(l.workspace->cols < n){
+        free_matrix(*l.workspace);
+        *l.workspace = make_matrix_garbage(1, n);
+    }
+    return l.workspace->data;
+}
+
+// Bytes of scratch memory a layer holds between calls: its workspace
+// plus any convolution columns kept for backward
+size_t layer_workspace_size(layer l)
+{
+    size_t size = 0;
+    if(l.workspace) size += (size_t)l.workspace->rows*l.workspace->cols*sizeof(float);
+    if(l.cols) size += (size_t)l.cols->rows*l.cols->cols*sizeof(float);
+    return size;
+}
+
+// Bytes of scratch memory held by all layers of a net
+size_t net_workspace_size(net n)
+{
+    size_t size = 0;
+    int i;
+    for(i = 0; i < n.n; ++i){
+        size += layer_workspace_size(n.layers[i]);
+    }
+    return size;
 }
 
 void free_net(net n)
@@ -88,6 +212,56 @@ void load_weights(net m, char *filename)
         layer l = m.layers[i];
         if(l.b.data) read_matrix(l.b, fp);
         if(l.w.data) read_matrix(l.w, fp);
+        refresh_space_to_depth_weights(l);
     }
     fclose(fp);
 }
+
+// Fold every batchnorm layer that directly follows a convolutional,
+// depthwise or connected layer into that layer's weights and biases, and
+// drop it from the net. Folded nets compute the inference (rolling
+// statistics) output in one pass and save weights load_weights reads
+// back into the same stack of layers built without the batchnorms.
+// net n: net to fold, its layers are updated in place so only the
+// returned net should be used afterwards
+// returns: n without the folded batchnorm layers
+net fold_batchnorm_net(net n)
+{
+    int i, j = 0;
+    for(i = 0; i < n.n; ++i){
+        layer l = n.layers[i];
+        if(j > 0 && l.forward == forward_batchnorm_layer){
+            layer prev = n.layers[j-1];
+            int epilogue = prev.forward == forward_convolutional_layer ||
+                           prev.forward == forward_connected_layer;
+            if(prev.activation == LINEAR &&
+               (epilogue || prev.forward == forward_depthwise_convolutional_layer)){
+                fold_batchnorm_layer(prev, l);
+                free_layer(l);
+                if(l.activation == LINEAR) continue;
+                // A fused activation moves into the GEMM epilogue of
+                // layers that have one, or stays behind as its own layer
+                if(epilogue){
+                    n.layers[j-1].activation = l.activation;
+                    continue;
+                }
+                l = make_activation_layer(l.activation);
+            }
+        }
+        n.layers[j++] = l;
+    }
+    n.n = j;
+    return n;
+}
+
+// Print the algorithm each convolutional layer of a net runs with
+void print_convolution_algorithms(net n)
+{
+    int i;
+    for(i = 0; i < n.n; ++i){
+        layer l = n.layers[i];
+        if(l.forward != forward_convolutional_layer) continue;
+        printf("%2d conv %3d x%3d x%3d -> %3d filters %dx%d/%d: %s\n", i, l.width, l.height, l.channels,
+               l.filters, l.size, l.size, l.stride, convolution_algorithm_name(l.algorithm));
+    }
+}
@@ -2,8 +2,10 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include "uwnet.h"
 #include "matrix.h"
 #include "image.h"
@@ -16,6 +18,8 @@ matrix normalize(matrix x, matrix m, matrix v, int groups);
 matrix delta_mean(matrix d, matrix v);
 matrix delta_variance(matrix d, matrix x, matrix m, matrix v);
 matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matrix x);
+float cross_entropy_loss(matrix x, matrix y);
+matrix cross_entropy_derivative(matrix x, matrix y);
 
 int tests_total = 0;
 int tests_fail = 0;
@@ -97,6 +101,41 @@ void test_matmul()
     free_matrix(mul);
 }
 
+void test_gemm()
+{
+    matrix a = random_matrix(7, 5, 1);
+    matrix b = random_matrix(5, 6, 1);
+    matrix at = transpose_matrix(a);
+    matrix bt = transpose_matrix(b);
+    matrix truth = matmul(a, b);
+    matrix c = random_matrix(7, 6, 1);
+    matrix acc = copy_matrix(c);
+    matrix truth_acc = copy_matrix(c);
+    scal_matrix(.5, truth_acc);
+    axpy_matrix(1, truth, truth_acc);
+
+    gemm(0, 0, 7, 6, 5, 1, a.data, 5, b.data, 6, 0, c.data, 6);
+    TEST(same_matrix(truth, c));
+    gemm(0, 1, 7, 6, 5, 1, a.data, 5, bt.data, 5, 0, c.data, 6);
+    TEST(same_matrix(truth, c));
+    gemm(1, 0, 7, 6, 5, 1, at.data, 7, b.data, 6, 0, c.data, 6);
+    TEST(same_matrix(truth, c));
+    gemm(1, 1, 7, 6, 5, 1, at.data, 7, bt.data, 5, 0, c.data, 6);
+    TEST(same_matrix(truth, c));
+
+    gemm(0, 0, 7, 6, 5, 1, a.data, 5, b.data, 6, .5, acc.data, 6);
+    TEST(same_matrix(truth_acc, acc));
+
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(at);
+    free_matrix(bt);
+    free_matrix(c);
+    free_matrix(acc);
+    free_matrix(truth);
+    free_matrix(truth_acc);
+}
+
 void test_activation_layer()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -160,6 +199,104 @@ void test_activation_layer()
     free_layer(soft_layer);
 }
 
+// Logistic and softmax use a polynomial exp: check it against expf over
+// the whole range, and that softmax handles inputs expf overflows on
+void test_fast_activations()
+{
+    int n = 1000;
+    int i;
+    float *x = calloc(n, sizeof(float));
+    float *y = calloc(n, sizeof(float));
+    int close = 1;
+    for(i = 0; i < n; ++i){
+        x[i] = y[i] = -85 + 170.f*i/n;
+    }
+    activate_array(y, n, LOGISTIC);
+    for(i = 0; i < n; ++i){
+        double truth = 1/(1 + exp(-(double)x[i]));
+        close &= fabs(y[i] - truth) <= 4*FLT_EPSILON*truth;
+    }
+    TEST(close);
+
+    float big[] = {1000, 1000 + logf(3), 999};
+    float small[] = {0, logf(3), -1};
+    activate_array(big, 3, SOFTMAX);
+    activate_array(small, 3, SOFTMAX);
+    TEST(!isnan(big[0]) && within_eps(big[0], small[0]) && within_eps(big[1], small[1]) && within_eps(big[2], small[2]));
+    TEST(within_eps(big[1], 3*big[0]));
+    free(x);
+    free(y);
+}
+
+// Activation layers match activate_array/gradient_array whether they
+// copy or, inside a net, work in place
+void test_inplace_activations()
+{
+    ACTIVATION as[] = {LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX};
+    int i, k;
+    for(k = 0; k < 5; ++k){
+        // 13 columns so the masks' last bytes are partial
+        matrix x = random_matrix(4, 13, 2);
+        matrix dy = random_matrix(4, 13, 2);
+        matrix truth_y = copy_matrix(x);
+        matrix truth_dx = copy_matrix(dy);
+        for(i = 0; i < x.rows; ++i){
+            activate_array(truth_y.data + i*x.cols, x.cols, as[k]);
+            gradient_array(x.data + i*x.cols, x.cols, as[k], truth_dx.data + i*x.cols);
+        }
+
+        layer l = make_activation_layer(as[k]);
+        matrix y = l.forward(l, x);
+        matrix dx = l.backward(l, dy);
+        TEST(same_matrix(truth_y, y));
+        TEST(same_matrix(truth_dx, dx));
+
+        net n = {&l, 1, NCHW};
+        matrix y_net = forward_net(n, x);
+        backward_net(n, dy);
+        TEST(same_matrix(truth_y, y_net));
+
+        free_matrix(x);
+        free_matrix(dy);
+        free_matrix(truth_y);
+        free_matrix(truth_dx);
+        free_matrix(y);
+        free_matrix(dx);
+        free_matrix(y_net);
+        free_layer(l);
+    }
+}
+
+// The fused loss matches a softmax layer followed by cross_entropy_loss
+// and its derivative, and stays finite on logits softmax alone can't take
+void test_softmax_cross_entropy()
+{
+    int i;
+    matrix x = random_matrix(6, 10, 4);
+    matrix y = make_matrix(6, 10);
+    for(i = 0; i < y.rows; ++i) y.data[i*y.cols + (3*i) % y.cols] = 1;
+    layer soft = make_activation_layer(SOFTMAX);
+    matrix p = soft.forward(soft, x);
+    float truth = cross_entropy_loss(p, y);
+    matrix truth_dx = cross_entropy_derivative(p, y);
+    matrix dx = make_matrix(x.rows, x.cols);
+    float loss = softmax_cross_entropy(x, y, dx);
+    TEST(within_eps(truth, loss));
+    TEST(same_matrix(truth_dx, dx));
+
+    // Shifting every logit by a constant changes nothing
+    for(i = 0; i < x.rows*x.cols; ++i) x.data[i] += 1000;
+    TEST(within_eps(truth, softmax_cross_entropy(x, y, dx)));
+    TEST(same_matrix(truth_dx, dx));
+
+    free_matrix(x);
+    free_matrix(y);
+    free_matrix(p);
+    free_matrix(truth_dx);
+    free_matrix(dx);
+    free_layer(soft);
+}
+
 void test_connected_layer()
 {
     matrix x = load_matrix("data/test/a.matrix");
@@ -221,16 +358,16 @@ void test_im2col()
     matrix col = im2col(im, 3, 2);
     matrix truth_col = load_matrix("data/test/im2col.matrix");
     printf("\n%dx%d: %dx%d\n", col.rows, col.cols, truth_col.rows, truth_col.cols);
-    // matrix col2 = im2col(im, 2, 2);
-    // matrix truth_col2 = load_matrix("data/test/im2col2.matrix");
+    matrix col2 = im2col(im, 2, 2);
+    matrix truth_col2 = load_matrix("data/test/im2col2.matrix");
     // print_matrix(truth_col);
     // print_matrix(col);
     TEST(same_matrix(truth_col,   col));
-    // TEST(same_matrix(truth_col2,  col2));
+    TEST(same_matrix(truth_col2,  col2));
     free_matrix(col);
-    // free_matrix(col2);
+    free_matrix(col2);
     free_matrix(truth_col);
-    // free_matrix(truth_col2);
+    free_matrix(truth_col2);
     free_image(im);
 }
 
@@ -265,6 +402,782 @@ void test_col2im()
     free_image(im);
 }
 
+// Direct convolution straight from the definition, used as ground truth
+// for the optimized convolutional layer paths.
+// layer l: convolutional layer providing weights and geometry
+// matrix in: batch of CHW inputs
+// matrix dy: dL/dy for the batch
+// matrix *out, *dx, *dw, *db: filled with y, dL/dx, dL/dw, dL/db
+void reference_convolution(layer l, matrix in, matrix dy, matrix *out, matrix *dx, matrix *dw, matrix *db)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    int pad = (l.size-1)/2*l.dilation;
+    int cg = l.channels/l.groups;
+    int fg = l.filters/l.groups;
+    int n, f, c, oy, ox, ky, kx;
+    *out = make_matrix(in.rows, l.filters*outw*outh);
+    *dx = make_matrix(in.rows, in.cols);
+    *dw = make_matrix(l.w.rows, l.w.cols);
+    *db = make_matrix(1, l.filters);
+    for(n = 0; n < in.rows; ++n){
+        for(f = 0; f < l.filters; ++f){
+            for(oy = 0; oy < outh; ++oy){
+                for(ox = 0; ox < outw; ++ox){
+                    int o = n*out->cols + (f*outh + oy)*outw + ox;
+                    float sum = l.b.data[f];
+                    db->data[f] += dy.data[o];
+                    for(c = 0; c < cg; ++c){
+                        for(ky = 0; ky < l.size; ++ky){
+                            for(kx = 0; kx < l.size; ++kx){
+                                int iy = oy*l.stride + ky*l.dilation - pad;
+                                int ix = ox*l.stride + kx*l.dilation - pad;
+                                if(iy < 0 || iy >= l.height || ix < 0 || ix >= l.width) continue;
+                                int wi = f*l.w.cols + (c*l.size + ky)*l.size + kx;
+                                int xi = n*in.cols + ((f/fg*cg + c)*l.height + iy)*l.width + ix;
+                                sum += l.w.data[wi]*in.data[xi];
+                                dw->data[wi] += dy.data[o]*in.data[xi];
+                                dx->data[xi] += dy.data[o]*l.w.data[wi];
+                            }
+                        }
+                    }
+                    out->data[o] = sum;
+                }
+            }
+        }
+    }
+}
+
+// Check a convolutional layer's forward and backward against the reference
+// layer l: layer to check, freed afterwards
+// int batch: number of examples to run
+// LAYOUT layout: layout to run the layer in, results are compared in NCHW
+void check_convolutional_layer(layer l, int batch, LAYOUT layout, int keep_cols)
+{
+    int outw = (l.width-1)/l.stride + 1;
+    int outh = (l.height-1)/l.stride + 1;
+    matrix in = random_matrix(batch, l.width*l.height*l.channels, 1);
+    matrix dy = random_matrix(batch, l.filters*outw*outh, 1);
+    matrix truth_out, truth_dx, truth_dw, truth_db;
+    free_matrix(l.b);
+    l.b = random_matrix(1, l.filters, 1);
+    reference_convolution(l, in, dy, &truth_out, &truth_dx, &truth_dw, &truth_db);
+
+    int outc = l.filters;
+    l.layout = layout;
+    l.keep_cols = keep_cols;
+    matrix lin = convert_layout(in, l.width, l.height, l.channels, NCHW, layout);
+    matrix ldy = convert_layout(dy, outw, outh, outc, NCHW, layout);
+    matrix lout = l.forward(l, lin);
+    matrix ldx = l.backward(l, ldy);
+    matrix out = convert_layout(lout, outw, outh, outc, layout, NCHW);
+    matrix dx = convert_layout(ldx, l.width, l.height, l.channels, layout, NCHW);
+    TEST(same_matrix(truth_out, out));
+    TEST(same_matrix(truth_dx, dx));
+    TEST(same_matrix(truth_dw, l.dw));
+    TEST(same_matrix(truth_db, l.db));
+
+    free_matrix(in);
+    free_matrix(dy);
+    free_matrix(lin);
+    free_matrix(ldy);
+    free_matrix(lout);
+    free_matrix(ldx);
+    free_matrix(out);
+    free_matrix(dx);
+    free_matrix(truth_out);
+    free_matrix(truth_dx);
+    free_matrix(truth_dw);
+    free_matrix(truth_db);
+    free_layer(l);
+}
+
+void test_convolutional_layer()
+{
+    LAYOUT layouts[] = {NCHW, NHWC};
+    int i;
+    for(i = 0; i < 4; ++i){
+        LAYOUT layout = layouts[i%2];
+        int keep = i/2;
+        check_convolutional_layer(make_convolutional_layer(7, 6, 3, 4, 3, 1), 3, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(7, 6, 3, 4, 3, 2), 3, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(7, 6, 3, 4, 3, 1), 13, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(7, 6, 3, 4, 2, 2), 3, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(7, 6, 5, 4, 1, 1), 3, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(9, 8, 2, 3, 5, 1), 2, layout, keep);
+        check_convolutional_layer(make_convolutional_layer(9, 8, 2, 3, 5, 3), 2, layout, keep);
+        check_convolutional_layer(make_grouped_convolutional_layer(7, 6, 6, 4, 3, 1, 2), 3, layout, keep);
+        check_convolutional_layer(make_grouped_convolutional_layer(7, 6, 6, 9, 3, 2, 3), 3, layout, keep);
+        check_convolutional_layer(make_grouped_convolutional_layer(7, 6, 6, 4, 1, 1, 2), 3, layout, keep);
+        check_convolutional_layer(make_dilated_convolutional_layer(9, 8, 3, 4, 3, 1, 2), 3, layout, keep);
+        check_convolutional_layer(make_dilated_convolutional_layer(9, 8, 3, 4, 3, 2, 3), 3, layout, keep);
+    }
+
+    // Direct convolution runs NCHW only
+    layer direct[] = {
+        make_convolutional_layer(7, 6, 3, 4, 3, 1),
+        make_convolutional_layer(7, 6, 3, 4, 2, 2),
+        make_convolutional_layer(9, 8, 2, 3, 5, 3),
+        make_grouped_convolutional_layer(7, 6, 6, 9, 3, 2, 3),
+        make_dilated_convolutional_layer(9, 8, 3, 4, 3, 1, 2),
+    };
+    for(i = 0; i < 5; ++i){
+        direct[i].algorithm = CONV_DIRECT;
+        check_convolutional_layer(direct[i], 3, NCHW, 0);
+    }
+
+    // Space-to-depth runs stride 2 NCHW layers, odd and even sizes
+    layer s2d[] = {
+        make_convolutional_layer(7, 6, 3, 4, 3, 2),
+        make_convolutional_layer(8, 9, 3, 4, 3, 2),
+        make_convolutional_layer(8, 9, 3, 4, 2, 2),
+        make_convolutional_layer(9, 8, 2, 3, 4, 2),
+        make_convolutional_layer(9, 8, 2, 3, 5, 2),
+        make_grouped_convolutional_layer(7, 6, 6, 9, 3, 2, 3),
+    };
+    for(i = 0; i < 6; ++i){
+        s2d[i].algorithm = CONV_SPACE_TO_DEPTH;
+        check_convolutional_layer(s2d[i], 3, NCHW, i%2);
+    }
+}
+
+// Space-to-depth packs its weights once and repacks them on update
+void test_space_to_depth_weights()
+{
+    layer l = make_convolutional_layer(7, 6, 3, 4, 3, 2);
+    layer p = make_convolutional_layer(7, 6, 3, 4, 3, 2);
+    free_matrix(p.w);
+    p.w = copy_matrix(l.w);
+    l.algorithm = CONV_SPACE_TO_DEPTH;
+    p.algorithm = CONV_GEMM;
+    matrix x = random_matrix(3, 7*6*3, 1);
+    free_matrix(l.forward(l, x));
+    float *packed = l.space_to_depth_w->data;
+
+    matrix dw = random_matrix(l.dw.rows, l.dw.cols, 1);
+    axpy_matrix(1, dw, l.dw);
+    axpy_matrix(1, dw, p.dw);
+    l.update(l, .1, .9, .01);
+    p.update(p, .1, .9, .01);
+    matrix y = l.forward(l, x);
+    matrix truth = p.forward(p, x);
+    TEST(l.space_to_depth_w->data == packed);
+    TEST(same_matrix(truth, y));
+
+    free_matrix(x);
+    free_matrix(dw);
+    free_matrix(y);
+    free_matrix(truth);
+    free_layer(l);
+    free_layer(p);
+}
+
+// forward_net tunes CONV_AUTO layers on their first TRAIN batch without
+// touching their gradients or the global RNG, and reads choices from
+// the cache file. EVAL batches leave them untuned.
+void test_convolution_tuning()
+{
+    net n = {0};
+    n.n = 1;
+    n.layers = calloc(n.n, sizeof(layer));
+    n.layers[0] = make_convolutional_layer(9, 8, 3, 4, 3, 1);
+    matrix x = random_matrix(3, 9*8*3, 1);
+    matrix row = x;
+    row.rows = 1;
+
+    n.mode = EVAL;
+    free_matrix(forward_net(n, row));
+    TEST(n.layers[0].algorithm == CONV_AUTO);
+    n.mode = TRAIN;
+
+    srand(5);
+    int next = rand();
+    srand(5);
+    matrix y = forward_net(n, x);
+    TEST(n.layers[0].algorithm != CONV_AUTO);
+    TEST(rand() == next);
+    matrix zero = make_matrix(n.layers[0].dw.rows, n.layers[0].dw.cols);
+    TEST(same_matrix(zero, n.layers[0].dw));
+    free_matrix(y);
+
+    char cache[] = "/tmp/uwnet_convXXXXXX";
+    int fd = mkstemp(cache);
+    FILE *fp = fdopen(fd, "w");
+    fprintf(fp, "9 8 3 4 3 1 1 1 0 3 %d\n", CONV_DIRECT);
+    fclose(fp);
+    set_convolution_cache(cache);
+    n.layers[0].algorithm = CONV_AUTO;
+    y = forward_net(n, x);
+    TEST(n.layers[0].algorithm == CONV_DIRECT);
+    set_convolution_cache(0);
+    remove(cache);
+
+    free_matrix(x);
+    free_matrix(y);
+    free_matrix(zero);
+    free_net(n);
+}
+
+// The workspace is sized by the first call and reused after that
+void test_convolutional_workspace()
+{
+    layer l = make_convolutional_layer(9, 8, 3, 4, 3, 1);
+    net n = {&l, 1, NCHW};
+    matrix in = random_matrix(4, 9*8*3, 1);
+    matrix dy = random_matrix(4, 9*8*4, 1);
+    matrix small = random_matrix(2, 9*8*3, 1);
+    matrix out = l.forward(l, in);
+    matrix dx = l.backward(l, dy);
+    float *ws = l.workspace->data;
+    size_t size = net_workspace_size(n);
+    TEST(size > 0 && size == layer_workspace_size(l));
+    free_matrix(out);
+    free_matrix(dx);
+    out = l.forward(l, small);
+    TEST(l.workspace->data == ws);
+    free_matrix(out);
+    out = l.forward(l, in);
+    dx = l.backward(l, dy);
+    TEST(l.workspace->data == ws);
+    TEST(net_workspace_size(n) == size);
+    free_matrix(out);
+    free_matrix(dx);
+    free_matrix(in);
+    free_matrix(dy);
+    free_matrix(small);
+    free_layer(l);
+}
+
+// Check a depthwise layer against a full convolution with block diagonal
+// weights, i.e. one that only connects filter c to channel c
+void check_depthwise_convolutional_layer(int w, int h, int c, int size, int stride, int dilation, LAYOUT layout)
+{
+    int batch = 3;
+    int kk = size*size;
+    int outw = (w-1)/stride + 1;
+    int outh = (h-1)/stride + 1;
+    int i, k;
+    layer l = make_depthwise_convolutional_layer(w, h, c, size, stride);
+    layer full = make_dilated_convolutional_layer(w, h, c, c, size, stride, dilation);
+    l.dilation = dilation;
+    free_matrix(l.b);
+    l.b = random_matrix(1, c, 1);
+    scal_matrix(0, full.w);
+    for(i = 0; i < c; ++i){
+        full.b.data[i] = l.b.data[i];
+        for(k = 0; k < kk; ++k){
+            full.w.data[i*full.w.cols + i*kk + k] = l.w.data[i*kk + k];
+        }
+    }
+    matrix in = random_matrix(batch, w*h*c, 1);
+    matrix dy = random_matrix(batch, outw*outh*c, 1);
+    matrix truth_out, truth_dx, truth_dw, truth_db;
+    reference_convolution(full, in, dy, &truth_out, &truth_dx, &truth_dw, &truth_db);
+    matrix truth_dw_diag = make_matrix(c, kk);
+    for(i = 0; i < c; ++i){
+        for(k = 0; k < kk; ++k){
+            truth_dw_diag.data[i*kk + k] = truth_dw.data[i*truth_dw.cols + i*kk + k];
+        }
+    }
+
+    l.layout = layout;
+    matrix lin = convert_layout(in, w, h, c, NCHW, layout);
+    matrix ldy = convert_layout(dy, outw, outh, c, NCHW, layout);
+    matrix lout = l.forward(l, lin);
+    matrix ldx = l.backward(l, ldy);
+    matrix out = convert_layout(lout, outw, outh, c, layout, NCHW);
+    matrix dx = convert_layout(ldx, w, h, c, layout, NCHW);
+    TEST(same_matrix(truth_out, out));
+    TEST(same_matrix(truth_dx, dx));
+    TEST(same_matrix(truth_dw_diag, l.dw));
+    TEST(same_matrix(truth_db, l.db));
+
+    free_matrix(in);
+    free_matrix(dy);
+    free_matrix(lin);
+    free_matrix(ldy);
+    free_matrix(lout);
+    free_matrix(ldx);
+    free_matrix(out);
+    free_matrix(dx);
+    free_matrix(truth_out);
+    free_matrix(truth_dx);
+    free_matrix(truth_dw);
+    free_matrix(truth_db);
+    free_matrix(truth_dw_diag);
+    free_layer(l);
+    free_layer(full);
+}
+
+void test_depthwise_convolutional_layer()
+{
+    check_depthwise_convolutional_layer(7, 6, 4, 3, 1, 1, NCHW);
+    check_depthwise_convolutional_layer(7, 6, 4, 3, 2, 1, NCHW);
+    check_depthwise_convolutional_layer(7, 6, 4, 3, 1, 1, NHWC);
+    check_depthwise_convolutional_layer(7, 6, 4, 3, 2, 1, NHWC);
+    check_depthwise_convolutional_layer(9, 8, 4, 3, 1, 2, NCHW);
+    check_depthwise_convolutional_layer(9, 8, 4, 3, 1, 2, NHWC);
+}
+
+// A layer with an activation in its GEMM epilogue matches the same layer
+// followed by an activation layer, forward and backward
+void check_epilogue_activation(layer l, layer plain, ACTIVATION a, int inputs, int outputs)
+{
+    matrix x = random_matrix(3, inputs, 1);
+    matrix dy = random_matrix(3, outputs, 1);
+    layer act = make_activation_layer(a);
+    l.activation = a;
+
+    matrix z = plain.forward(plain, x);
+    matrix truth_y = act.forward(act, z);
+    matrix dz = act.backward(act, dy);
+    matrix truth_dx = plain.backward(plain, dz);
+    matrix y = l.forward(l, x);
+    matrix dx = l.backward(l, dy);
+    TEST(same_matrix(truth_y, y));
+    TEST(same_matrix(truth_dx, dx));
+    TEST(same_matrix(plain.dw, l.dw));
+    TEST(same_matrix(plain.db, l.db));
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(z);
+    free_matrix(truth_y);
+    free_matrix(dz);
+    free_matrix(truth_dx);
+    free_matrix(y);
+    free_matrix(dx);
+    free_layer(act);
+}
+
+void test_epilogue_activations()
+{
+    ACTIVATION as[] = {RELU, LRELU, LOGISTIC};
+    CONV_ALGORITHM algorithms[] = {CONV_GEMM, CONV_DIRECT, CONV_SPACE_TO_DEPTH};
+    int i, k;
+    for(k = 0; k < 3; ++k){
+        layer c = make_connected_layer(7, 5);
+        layer plain = make_connected_layer(7, 5);
+        free_matrix(plain.w);
+        free_matrix(plain.b);
+        plain.w = copy_matrix(c.w);
+        plain.b = random_matrix(1, 5, 1);
+        free_matrix(c.b);
+        c.b = copy_matrix(plain.b);
+        check_epilogue_activation(c, plain, as[k], 7, 5);
+        free_layer(c);
+        free_layer(plain);
+
+        for(i = 0; i < 6; ++i){
+            layer l = make_convolutional_layer(8, 7, 3, 4, 3, 2);
+            layer p = make_convolutional_layer(8, 7, 3, 4, 3, 2);
+            free_matrix(p.w);
+            free_matrix(p.b);
+            p.w = copy_matrix(l.w);
+            p.b = random_matrix(1, 4, 1);
+            free_matrix(l.b);
+            l.b = copy_matrix(p.b);
+            l.algorithm = p.algorithm = algorithms[i/2];
+            l.layout = p.layout = i%2 ? NHWC : NCHW;
+            if(convolution_algorithm_eligible(l, l.algorithm)){
+                check_epilogue_activation(l, p, as[k], 8*7*3, 4*4*4);
+            }
+            free_layer(l);
+            free_layer(p);
+        }
+    }
+}
+
+// Build the net test_fold_batchnorm folds, with or without batchnorms
+net make_fold_test_net(int batchnorm)
+{
+    net n = {0};
+    n.layers = calloc(8, sizeof(layer));
+    n.layers[n.n++] = make_convolutional_layer(6, 5, 3, 4, 3, 1);
+    if(batchnorm) n.layers[n.n++] = make_batchnorm_activation_layer(4, RELU);
+    else n.layers[n.n++] = make_activation_layer(RELU);
+    n.layers[n.n++] = make_depthwise_convolutional_layer(6, 5, 4, 3, 2);
+    if(batchnorm) n.layers[n.n++] = make_batchnorm_layer(4);
+    n.layers[n.n++] = make_connected_layer(3*3*4, 5);
+    if(batchnorm) n.layers[n.n++] = make_batchnorm_layer(5);
+    return n;
+}
+
+// A folded net matches the unfolded one in EVAL mode, and its saved
+// weights load into the same net built without batchnorms
+void test_fold_batchnorm()
+{
+    net n = make_fold_test_net(1);
+    matrix x = random_matrix(4, 6*5*3, 1);
+    int i;
+    for(i = 0; i < 5; ++i) free_matrix(forward_net(n, x));
+
+    n.mode = EVAL;
+    matrix truth = forward_net(n, x);
+
+    n = fold_batchnorm_net(n);
+    TEST(n.n == 3 && n.layers[0].activation == RELU);
+    matrix y = forward_net(n, x);
+    TEST(same_matrix(truth, y));
+
+    char weights[] = "/tmp/uwnet_foldXXXXXX";
+    close(mkstemp(weights));
+    save_weights(n, weights);
+    net loaded = make_fold_test_net(0);
+    load_weights(loaded, weights);
+    remove(weights);
+    matrix y_loaded = forward_net(loaded, x);
+    TEST(same_matrix(truth, y_loaded));
+
+    free_matrix(x);
+    free_matrix(truth);
+    free_matrix(y);
+    free_matrix(y_loaded);
+    free_net(n);
+    free_net(loaded);
+}
+
+// EVAL mode uses rolling statistics for any batch size and leaves every
+// layer's saved state and statistics alone
+void test_eval_mode()
+{
+    net n = make_fold_test_net(1);
+    matrix x = random_matrix(4, 6*5*3, 1);
+    matrix x2 = random_matrix(3, 6*5*3, 1);
+    free_matrix(forward_net(n, x));
+    matrix saved = copy_matrix(*n.layers[0].x);
+    matrix rolling = copy_matrix(n.layers[1].rolling_mean);
+
+    n.mode = EVAL;
+    matrix y = forward_net(n, x);
+    matrix y2 = forward_net(n, x2);
+    TEST(same_matrix(saved, *n.layers[0].x));
+    TEST(same_matrix(rolling, n.layers[1].rolling_mean));
+
+    // Each example's output doesn't depend on the rest of the batch
+    matrix row = x;
+    row.rows = 1;
+    row.data = x.data + x.cols;
+    matrix y1 = forward_net(n, row);
+    matrix truth = y;
+    truth.rows = 1;
+    truth.data = y.data + y.cols;
+    TEST(same_matrix(truth, y1));
+
+    free_matrix(x);
+    free_matrix(x2);
+    free_matrix(saved);
+    free_matrix(rolling);
+    free_matrix(y);
+    free_matrix(y2);
+    free_matrix(y1);
+    free_net(n);
+}
+
+// An INFERENCE net matches EVAL without gradients or saved state, and
+// tunes its convolutions without touching them
+void test_inference_net()
+{
+    net n = make_fold_test_net(1);
+    // Put a maxpool between the activation and the depthwise layer
+    memmove(n.layers + 3, n.layers + 2, (n.n - 2)*sizeof(layer));
+    n.layers[2] = make_maxpool_layer(6, 5, 4, 3, 1);
+    ++n.n;
+    matrix x = random_matrix(4, 6*5*3, 1);
+    matrix dy = random_matrix(4, 5, 1);
+    free_matrix(forward_net(n, x));
+    backward_net(n, dy);
+    n.mode = EVAL;
+    matrix truth = forward_net(n, x);
+
+    n = inference_net(n);
+    n.layers[0].algorithm = CONV_AUTO;
+    matrix y = forward_net(n, x);
+    TEST(same_matrix(truth, y));
+    TEST(n.layers[0].algorithm != CONV_AUTO);
+    int i, empty = 1;
+    for(i = 0; i < n.n; ++i){
+        layer l = n.layers[i];
+        if(l.dw.data || l.db.data || l.batch_mean.data || l.batch_rstd.data) empty = 0;
+        if(l.x && l.x->data) empty = 0;
+        if(l.cols && l.cols->data) empty = 0;
+        if(l.activation_state && *l.activation_state) empty = 0;
+        if(l.argmax && *l.argmax) empty = 0;
+    }
+    TEST(empty);
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(truth);
+    free_matrix(y);
+    free_net(n);
+}
+
+// Kept columns are reused by later batches that fit in them
+void test_kept_columns()
+{
+    layer l = make_convolutional_layer(9, 8, 3, 4, 3, 1);
+    l.keep_cols = 1;
+    matrix in = random_matrix(4, 9*8*3, 1);
+    matrix small = random_matrix(2, 9*8*3, 1);
+    free_matrix(l.forward(l, in));
+    float *cols = l.cols->data;
+    free_matrix(l.forward(l, in));
+    TEST(l.cols->data == cols && l.cols->cols == 4*9*8);
+    free_matrix(l.forward(l, small));
+    TEST(l.cols->data == cols && l.cols->cols == 2*9*8);
+    free_matrix(in);
+    free_matrix(small);
+    free_layer(l);
+}
+
+// Run the same small conv net in NCHW and NHWC and compare
+void test_nhwc_net()
+{
+    net n = {0};
+    n.n = 4;
+    n.layers = calloc(n.n, sizeof(layer));
+    n.layers[0] = make_convolutional_layer(8, 6, 3, 4, 3, 1);
+    n.layers[1] = make_batchnorm_layer(4);
+    n.layers[2] = make_activation_layer(RELU);
+    n.layers[3] = make_maxpool_layer(8, 6, 4, 3, 2);
+
+    matrix x = random_matrix(5, 8*6*3, 1);
+    matrix dy = random_matrix(5, 4*3*4, 1);
+
+    matrix y = forward_net(n, x);
+    backward_net(n, dy);
+    matrix dw = copy_matrix(n.layers[0].dw);
+    scal_matrix(0, n.layers[0].dw);
+
+    n.layout = NHWC;
+    matrix dy_hwc = convert_layout(dy, 4, 3, 4, NCHW, NHWC);
+    matrix y_hwc = forward_net(n, x);
+    backward_net(n, dy_hwc);
+    matrix y_chw = convert_layout(y_hwc, 4, 3, 4, NHWC, NCHW);
+
+    TEST(same_matrix(y, y_chw));
+    TEST(same_matrix(dw, n.layers[0].dw));
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(y);
+    free_matrix(dw);
+    free_matrix(dy_hwc);
+    free_matrix(y_hwc);
+    free_matrix(y_chw);
+    free_net(n);
+}
+
+// Specialized kernels must match the generic ones they are compiled from
+void test_specialized_kernels()
+{
+    int sizes[] = {1, 3, 3, 2};
+    int strides[] = {1, 1, 2, 2};
+    int w = 9, h = 7, c = 3;
+    int i;
+    for(i = 0; i < 4; ++i){
+        int size = sizes[i];
+        int stride = strides[i];
+        int outw = (w-1)/stride + 1;
+        int outh = (h-1)/stride + 1;
+        im2col_kernel im2col;
+        col2im_kernel col2im;
+        find_im2col_kernels(size, stride, &im2col, &col2im);
+        maxpool_kernel maxpool = find_maxpool_kernel(size, stride);
+        TEST(im2col != im2col_cpu && col2im != col2im_cpu && maxpool != maxpool_cpu);
+
+        matrix x = random_matrix(1, w*h*c, 1);
+        matrix cols = make_matrix(c*size*size, outw*outh);
+        matrix truth_cols = make_matrix(c*size*size, outw*outh);
+        im2col(x.data, w, h, c, size, stride, 1, cols.data, cols.cols);
+        im2col_cpu(x.data, w, h, c, size, stride, 1, truth_cols.data, truth_cols.cols);
+        TEST(same_matrix(truth_cols, cols));
+
+        matrix dx = make_matrix(1, w*h*c);
+        matrix truth_dx = make_matrix(1, w*h*c);
+        col2im(cols.data, cols.cols, w, h, c, size, stride, 1, dx.data);
+        col2im_cpu(cols.data, cols.cols, w, h, c, size, stride, 1, truth_dx.data);
+        TEST(same_matrix(truth_dx, dx));
+
+        matrix max = make_matrix(1, outw*outh);
+        matrix truth_max = make_matrix(1, outw*outh);
+        unsigned char *arg = calloc(outw*outh, 1);
+        unsigned char *truth_arg = calloc(outw*outh, 1);
+        maxpool(x.data, w, h, size, stride, max.data, arg);
+        maxpool_cpu(x.data, w, h, size, stride, truth_max.data, truth_arg);
+        TEST(same_matrix(truth_max, max));
+        TEST(!memcmp(arg, truth_arg, outw*outh));
+
+        free_matrix(x);
+        free_matrix(cols);
+        free_matrix(truth_cols);
+        free_matrix(dx);
+        free_matrix(truth_dx);
+        free_matrix(max);
+        free_matrix(truth_max);
+        free(arg);
+        free(truth_arg);
+    }
+}
+
+// Check a maxpool layer against a per-window scan on inputs that are
+// mostly negative, in the given layout
+void check_maxpool_layer(int w, int h, int c, int size, int stride, LAYOUT layout)
+{
+    int batch = 3;
+    int outw = (w-1)/stride + 1;
+    int outh = (h-1)/stride + 1;
+    int pad = (size-1)/2;
+    int i, k, oy, ox, ky, kx;
+    layer l = make_maxpool_layer(w, h, c, size, stride);
+    matrix in = random_matrix(batch, w*h*c, 1);
+    for(i = 0; i < in.rows*in.cols; ++i) in.data[i] -= 2;
+    matrix dy = random_matrix(batch, outw*outh*c, 1);
+    matrix truth_y = make_matrix(batch, outw*outh*c);
+    matrix truth_dx = make_matrix(batch, w*h*c);
+    for(i = 0; i < batch; ++i){
+        for(k = 0; k < c; ++k){
+            for(oy = 0; oy < outh; ++oy){
+                for(ox = 0; ox < outw; ++ox){
+                    float max = -FLT_MAX;
+                    int arg = 0;
+                    for(ky = 0; ky < size; ++ky){
+                        for(kx = 0; kx < size; ++kx){
+                            int iy = oy*stride + ky - pad;
+                            int ix = ox*stride + kx - pad;
+                            if(iy < 0 || iy >= h || ix < 0 || ix >= w) continue;
+                            int index = i*in.cols + (k*h + iy)*w + ix;
+                            if(in.data[index] > max){
+                                max = in.data[index];
+                                arg = index;
+                            }
+                        }
+                    }
+                    int o = i*dy.cols + (k*outh + oy)*outw + ox;
+                    truth_y.data[o] = max;
+                    truth_dx.data[arg] += dy.data[o];
+                }
+            }
+        }
+    }
+
+    l.layout = layout;
+    matrix lin = convert_layout(in, w, h, c, NCHW, layout);
+    matrix ldy = convert_layout(dy, outw, outh, c, NCHW, layout);
+
+    // EVAL computes the same maxes without recording where they came from
+    l.mode = EVAL;
+    matrix ly_eval = l.forward(l, lin);
+    matrix y_eval = convert_layout(ly_eval, outw, outh, c, layout, NCHW);
+    TEST(same_matrix(truth_y, y_eval));
+    TEST(*l.argmax == 0);
+    free_matrix(ly_eval);
+    free_matrix(y_eval);
+    l.mode = TRAIN;
+
+    matrix ly = l.forward(l, lin);
+    matrix ldx = l.backward(l, ldy);
+    matrix y = convert_layout(ly, outw, outh, c, layout, NCHW);
+    matrix dx = convert_layout(ldx, w, h, c, layout, NCHW);
+    TEST(same_matrix(truth_y, y));
+    TEST(same_matrix(truth_dx, dx));
+
+    free_matrix(in);
+    free_matrix(dy);
+    free_matrix(truth_y);
+    free_matrix(truth_dx);
+    free_matrix(lin);
+    free_matrix(ldy);
+    free_matrix(ly);
+    free_matrix(ldx);
+    free_matrix(y);
+    free_matrix(dx);
+    free_layer(l);
+}
+
+// Check an average pool layer against a per-window loop. Global average
+// pools are checked as one window covering the whole image.
+void check_avgpool_layer(int w, int h, int c, int size, int stride, int global, LAYOUT layout)
+{
+    int batch = 3;
+    int outw = global ? 1 : (w-1)/stride + 1;
+    int outh = global ? 1 : (h-1)/stride + 1;
+    int pad = global ? 0 : (size-1)/2;
+    int i, k, oy, ox, ky, kx;
+    if(global){
+        size = w > h ? w : h;
+        stride = 1;
+    }
+    layer l = global ? make_global_avgpool_layer(w, h, c) : make_avgpool_layer(w, h, c, size, stride);
+    matrix in = random_matrix(batch, w*h*c, 1);
+    matrix dy = random_matrix(batch, outw*outh*c, 1);
+    matrix truth_y = make_matrix(batch, outw*outh*c);
+    matrix truth_dx = make_matrix(batch, w*h*c);
+    for(i = 0; i < batch; ++i){
+        for(k = 0; k < c; ++k){
+            for(oy = 0; oy < outh; ++oy){
+                for(ox = 0; ox < outw; ++ox){
+                    int o = i*dy.cols + (k*outh + oy)*outw + ox;
+                    int n = 0;
+                    for(ky = 0; ky < size; ++ky){
+                        for(kx = 0; kx < size; ++kx){
+                            int iy = oy*stride + ky - pad;
+                            int ix = ox*stride + kx - pad;
+                            if(iy < 0 || iy >= h || ix < 0 || ix >= w) continue;
+                            truth_y.data[o] += in.data[i*in.cols + (k*h + iy)*w + ix];
+                            ++n;
+                        }
+                    }
+                    truth_y.data[o] /= n;
+                    for(ky = 0; ky < size; ++ky){
+                        for(kx = 0; kx < size; ++kx){
+                            int iy = oy*stride + ky - pad;
+                            int ix = ox*stride + kx - pad;
+                            if(iy < 0 || iy >= h || ix < 0 || ix >= w) continue;
+                            truth_dx.data[i*in.cols + (k*h + iy)*w + ix] += dy.data[o]/n;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    l.layout = layout;
+    matrix lin = convert_layout(in, w, h, c, NCHW, layout);
+    matrix ldy = convert_layout(dy, outw, outh, c, NCHW, layout);
+    matrix ly = l.forward(l, lin);
+    matrix ldx = l.backward(l, ldy);
+    matrix y = convert_layout(ly, outw, outh, c, layout, NCHW);
+    matrix dx = convert_layout(ldx, w, h, c, layout, NCHW);
+    TEST(same_matrix(truth_y, y));
+    TEST(same_matrix(truth_dx, dx));
+
+    free_matrix(in);
+    free_matrix(dy);
+    free_matrix(truth_y);
+    free_matrix(truth_dx);
+    free_matrix(lin);
+    free_matrix(ldy);
+    free_matrix(ly);
+    free_matrix(ldx);
+    free_matrix(y);
+    free_matrix(dx);
+    free_layer(l);
+}
+
+void test_avgpool_layer()
+{
+    LAYOUT layouts[] = {NCHW, NHWC};
+    int i;
+    for(i = 0; i < 2; ++i){
+        check_avgpool_layer(9, 8, 3, 2, 2, 0, layouts[i]);
+        check_avgpool_layer(9, 8, 3, 3, 2, 0, layouts[i]);
+        check_avgpool_layer(8, 9, 3, 3, 1, 0, layouts[i]);
+        check_avgpool_layer(10, 7, 2, 5, 3, 0, layouts[i]);
+        check_avgpool_layer(7, 5, 4, 0, 0, 1, layouts[i]);
+    }
+}
 
 void test_maxpool_layer()
 {
@@ -304,6 +1217,15 @@ void test_maxpool_layer()
     TEST(same_matrix(truth_max_dx, max_dx));
     TEST(same_matrix(truth_max_dx3, max_dx3));
 
+    LAYOUT layouts[] = {NCHW, NHWC};
+    int i;
+    for(i = 0; i < 2; ++i){
+        check_maxpool_layer(9, 8, 3, 2, 2, layouts[i]);
+        check_maxpool_layer(9, 8, 3, 3, 2, layouts[i]);
+        check_maxpool_layer(8, 9, 3, 3, 1, layouts[i]);
+        check_maxpool_layer(10, 7, 2, 5, 3, layouts[i]);
+    }
+
 
     free_matrix(max_y);
     free_matrix(max_y3);
@@ -320,6 +1242,87 @@ void test_maxpool_layer()
     free_layer(max_l3);
 }
 
+// Check a batchnorm layer's forward and backward against the two pass
+// reference functions. The input is offset so a one pass E[x^2] - E[x]^2
+// would lose the variance.
+void check_batchnorm_layer(LAYOUT layout)
+{
+    int w = 5, h = 4, c = 6, batch = 7;
+    matrix x = random_matrix(batch, w*h*c, 1);
+    matrix dy = random_matrix(batch, w*h*c, 1);
+    int i;
+    for(i = 0; i < x.rows*x.cols; ++i) x.data[i] += 1000;
+
+    matrix m = mean(x, c);
+    matrix v = variance(x, m, c);
+    matrix truth_y = normalize(x, m, v, c);
+    matrix dm = delta_mean(dy, v);
+    matrix dv = delta_variance(dy, x, m, v);
+    matrix truth_dx = delta_batch_norm(dy, dm, dv, m, v, x);
+
+    layer l = make_batchnorm_layer(c);
+    l.layout = layout;
+    matrix lx = convert_layout(x, w, h, c, NCHW, layout);
+    matrix ldy = convert_layout(dy, w, h, c, NCHW, layout);
+    matrix ly = l.forward(l, lx);
+    matrix ldx = l.backward(l, ldy);
+    matrix y = convert_layout(ly, w, h, c, layout, NCHW);
+    matrix dx = convert_layout(ldx, w, h, c, layout, NCHW);
+    TEST(same_matrix(truth_y, y));
+    TEST(same_matrix(truth_dx, dx));
+    TEST(same_matrix(m, l.batch_mean));
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(m);
+    free_matrix(v);
+    free_matrix(truth_y);
+    free_matrix(dm);
+    free_matrix(dv);
+    free_matrix(truth_dx);
+    free_matrix(lx);
+    free_matrix(ldy);
+    free_matrix(ly);
+    free_matrix(ldx);
+    free_matrix(y);
+    free_matrix(dx);
+    free_layer(l);
+}
+
+// A fused batchnorm + activation layer matches the two layers run one
+// after the other
+void check_batchnorm_activation_layer(ACTIVATION a, LAYOUT layout)
+{
+    int spatial = 5*4, c = 6, batch = 7;
+    matrix x = random_matrix(batch, spatial*c, 1);
+    matrix dy = random_matrix(batch, spatial*c, 1);
+    layer bn = make_batchnorm_layer(c);
+    layer act = make_activation_layer(a);
+    layer fused = make_batchnorm_activation_layer(c, a);
+    bn.layout = fused.layout = layout;
+
+    matrix norm = bn.forward(bn, x);
+    matrix truth_y = act.forward(act, norm);
+    matrix dnorm = act.backward(act, dy);
+    matrix truth_dx = bn.backward(bn, dnorm);
+    matrix y = fused.forward(fused, x);
+    matrix dx = fused.backward(fused, dy);
+    TEST(same_matrix(truth_y, y));
+    TEST(same_matrix(truth_dx, dx));
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(norm);
+    free_matrix(truth_y);
+    free_matrix(dnorm);
+    free_matrix(truth_dx);
+    free_matrix(y);
+    free_matrix(dx);
+    free_layer(bn);
+    free_layer(act);
+    free_layer(fused);
+}
+
 void test_batchnorm_layer()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -570,6 +1573,43 @@ void make_matrix_test()
 }
 
 
+// Time forward + backward of tryhw2's first layer and a wider stride 2
+// layer with each algorithm that can run it
+void test_convolution_speed()
+{
+    layer layers[] = {
+        make_convolutional_layer(32, 32, 3, 8, 3, 2),
+        make_convolutional_layer(64, 64, 16, 32, 3, 2),
+    };
+    int batch = 128;
+    int n = 10;
+    int i, j, a;
+    for(i = 0; i < 2; ++i){
+        layer l = layers[i];
+        int outw = (l.width-1)/l.stride + 1;
+        int outh = (l.height-1)/l.stride + 1;
+        matrix x = random_matrix(batch, l.width*l.height*l.channels, 1);
+        matrix dy = random_matrix(batch, outw*outh*l.filters, 1);
+        for(a = 0; a < CONV_AUTO; ++a){
+            l.algorithm = a;
+            if(!convolution_algorithm_eligible(l, a)) continue;
+            double start = what_time_is_it_now();
+            for(j = 0; j < n; ++j){
+                matrix y = l.forward(l, x);
+                matrix dx = l.backward(l, dy);
+                free_matrix(y);
+                free_matrix(dx);
+            }
+            printf("conv %dx%dx%d -> %d %dx%d/%d, batch %d, %-14s %lf sec\n", l.width, l.height, l.channels,
+                   l.filters, l.size, l.size, l.stride, batch, convolution_algorithm_name(a),
+                   (what_time_is_it_now() - start)/n);
+        }
+        free_matrix(x);
+        free_matrix(dy);
+        free_layer(l);
+    }
+}
+
 void test_matrix_speed()
 {
     int i;
@@ -599,10 +1639,33 @@ void run_tests()
     // test_matmul();
     // test_activation_layer();
     // test_connected_layer();
+    test_fast_activations();
+    test_inplace_activations();
+    test_softmax_cross_entropy();
+    test_gemm();
     test_im2col();
     test_col2im();
+    test_convolutional_layer();
+    test_convolutional_workspace();
+    test_kept_columns();
+    test_convolution_tuning();
+    test_space_to_depth_weights();
+    test_nhwc_net();
+    test_depthwise_convolutional_layer();
     test_maxpool_layer();
+    test_avgpool_layer();
+    test_specialized_kernels();
     test_batchnorm_layer();
+    test_fold_batchnorm();
+    test_epilogue_activations();
+    test_eval_mode();
+    test_inference_net();
+    check_batchnorm_layer(NCHW);
+    check_batchnorm_layer(NHWC);
+    check_batchnorm_activation_layer(RELU, NCHW);
+    check_batchnorm_activation_layer(LRELU, NHWC);
+    check_batchnorm_activation_layer(LOGISTIC, NCHW);
+    check_batchnorm_activation_layer(LOGISTIC, NHWC);
 
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
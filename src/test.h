@@ -9,4 +9,5 @@ extern int tests_fail;
     ++tests_fail; }else{fprintf(stderr, "passed: [%s] testing [%s] in %s, line %d\n", __FUNCTION__, #EX, __FILE__, __LINE__);}} while (0)
 
 void run_tests();
+void test_convolution_speed();
 #endif
@@ -12,8 +12,55 @@ extern "C" {
 // The kinds of activations our framework supports
 typedef enum{LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX} ACTIVATION;
 
+// Memory layout of each row (example) of a spatial tensor:
+// NCHW is channels-first (CHW per row), NHWC is channels-last (HWC per row)
+typedef enum{NCHW, NHWC} LAYOUT;
+
+// TRAIN saves what backward needs and uses batch statistics, EVAL only
+// computes outputs: nothing is saved and batchnorm uses its rolling
+// statistics for any batch size. INFERENCE runs like EVAL on a net whose
+// gradients and saved state were released by inference_net, so it can
+// never be trained again
+typedef enum{TRAIN, EVAL, INFERENCE} MODE;
+
+// What layers apply to each row of a GEMM result, see
+// bias_activation_epilogue
+typedef struct bias_activation {
+    // M biases if per_row, else N, or 0 for none
+    float *bias;
+    int per_row;
+    // Elementwise activation, not SOFTMAX
+    ACTIVATION a;
+} bias_activation;
+
+// Ways to compute a convolution, CONV_AUTO layers are benchmarked by
+// forward_net on their first TRAIN or INFERENCE batch and locked to the
+// fastest, EVAL batches run them as GEMM until then
+typedef enum{CONV_GEMM, CONV_DIRECT, CONV_SPACE_TO_DEPTH, CONV_AUTO} CONV_ALGORITHM;
+
+// Spatial kernels. Layers pick versions compiled for their size and
+// stride when they are made, falling back to generic ones
+typedef void (*im2col_kernel)(float *data, int w, int h, int c, int size, int stride, int dilation, float *col, int ldc);
+typedef void (*col2im_kernel)(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, float *data);
+typedef void (*maxpool_kernel)(float *in, int w, int h, int size, int stride, float *out, unsigned char *arg);
+
+// Kernel bodies are force inlined into their specializations, where size
+// and stride are constants the compiler can unroll and fold
+#define SPECIALIZABLE static inline __attribute__((always_inline))
+
 typedef struct layer {
     matrix *x;
+    // Convolution columns saved by forward when keep_cols is set
+    matrix *cols;
+    // Scratch memory kept across calls, grown to the largest need seen
+    matrix *workspace;
+    // Weights repacked for space-to-depth, see space_to_depth_layer
+    matrix *space_to_depth_w;
+    // Maxpool: window offset of each output's max, saved by forward
+    unsigned char **argmax;
+    // What backward needs from the activated outputs, see
+    // activation_state_bytes
+    unsigned char **activation_state;
 
     // Weights
     matrix w;
@@ -26,6 +73,19 @@ typedef struct layer {
     // Image dimensions
     int width, height, channels;
     int size, stride, filters;
+    int groups, dilation;
+    // Convolution: 1 keeps forward's im2col columns for backward (faster),
+    // 0 recomputes them in backward (less memory)
+    int keep_cols;
+    CONV_ALGORITHM algorithm;
+    im2col_kernel im2col;
+    col2im_kernel col2im;
+    maxpool_kernel maxpool;
+    LAYOUT layout;
+    MODE mode;
+    // Set by forward_net and backward_net on layers that may overwrite
+    // their input and return it, since the nets free it anyway
+    int in_place;
     ACTIVATION activation;
 
     // Batch norm matrices
@@ -33,6 +93,10 @@ typedef struct layer {
     matrix x_norm;
     matrix rolling_mean;
     matrix rolling_variance;
+    // Statistics of the last training batch, 1/sqrt(variance + epsilon)
+    // is kept rather than the variance
+    matrix batch_mean;
+    matrix batch_rstd;
 
     matrix  (*forward)  (struct layer, struct matrix);
     matrix  (*backward) (struct layer, struct matrix);
@@ -42,13 +106,24 @@ typedef struct layer {
 layer make_connected_layer(int inputs, int outputs);
 layer make_activation_layer(ACTIVATION activation);
 layer make_convolutional_layer(int w, int h, int c, int filters, int size, int stride);
+layer make_grouped_convolutional_layer(int w, int h, int c, int filters, int size, int stride, int groups);
+layer make_dilated_convolutional_layer(int w, int h, int c, int filters, int size, int stride, int dilation);
 layer make_maxpool_layer(int w, int h, int c, int size, int stride);
+layer make_avgpool_layer(int w, int h, int c, int size, int stride);
+layer make_global_avgpool_layer(int w, int h, int c);
 layer make_batchnorm_layer(int groups);
+layer make_batchnorm_activation_layer(int groups, ACTIVATION a);
+layer make_depthwise_convolutional_layer(int w, int h, int c, int size, int stride);
 
 
 typedef struct {
     layer *layers;
     int n;
+    // Layout used inside the net, inputs are always given as NCHW and
+    // are converted once on the way in
+    LAYOUT layout;
+    // Set by forward_net on every layer, nets start out in TRAIN
+    MODE mode;
 } net;
 
 matrix forward_net(net m, matrix x);
@@ -56,6 +131,14 @@ void backward_net(net m, matrix d);
 void update_net(net m, float rate, float momentum, float decay);
 void free_layer(layer l);
 void free_net(net n);
+float *layer_workspace(layer l, int n);
+size_t layer_workspace_size(layer l);
+size_t net_workspace_size(net n);
+void print_convolution_algorithms(net n);
+net fold_batchnorm_net(net n);
+net inference_net(net n);
+void save_weights(net m, char *filename);
+void load_weights(net m, char *filename);
 
 typedef struct{
     matrix x;
@@ -64,13 +147,40 @@ typedef struct{
 data random_batch(data d, int n);
 data load_image_classification_data(char *images, char *label_file);
 void free_data(data d);
+matrix convert_layout(matrix x, int w, int h, int c, LAYOUT from, LAYOUT to);
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay);
+float softmax_cross_entropy(matrix x, matrix y, matrix dx);
 float accuracy_net(net m, data d);
 
 char *fgetl(FILE *fp);
 
 matrix im2col(image im, int size, int stride);
 image col2im(int width, int height, int channels, matrix col, int size, int stride);
+void im2col_cpu(float *data, int w, int h, int c, int size, int stride, int dilation, float *col, int ldc);
+void col2im_cpu(float *col, int ldc, int w, int h, int c, int size, int stride, int dilation, float *data);
+void valid_range(int n, int outn, int offset, int stride, int *start, int *end);
+void find_im2col_kernels(int size, int stride, im2col_kernel *im2col, col2im_kernel *col2im);
+void maxpool_cpu(float *in, int w, int h, int size, int stride, float *out, unsigned char *arg);
+maxpool_kernel find_maxpool_kernel(int size, int stride);
+void update_convolutional_layer(layer l, float rate, float momentum, float decay);
+void refresh_space_to_depth_weights(layer l);
+matrix forward_convolutional_layer(layer l, matrix in);
+matrix forward_depthwise_convolutional_layer(layer l, matrix in);
+matrix forward_connected_layer(layer l, matrix x);
+matrix forward_activation_layer(layer l, matrix x);
+matrix forward_batchnorm_layer(layer l, matrix x);
+void fold_batchnorm_layer(layer l, layer bn);
+void activate_array(float *x, int n, ACTIVATION a);
+float exp_shifted(float *x, int n, float shift, float *out);
+void gradient_array(float *x, int n, ACTIVATION a, float *delta);
+void save_activation_state(layer l, matrix y);
+void activation_state_gradient(layer l, matrix d);
+void bias_activation_epilogue(float *c, int i, int n, void *arg);
+void set_convolution_cache(char *filename);
+CONV_ALGORITHM tune_convolutional_layer(layer l, matrix x);
+int convolutional_threads(int n);
+int convolution_algorithm_eligible(layer l, CONV_ALGORITHM a);
+char *convolution_algorithm_name(CONV_ALGORITHM a);
 
 #ifdef __cplusplus
 }
@@ -37,6 +37,11 @@ class LAYER(Structure):
     pass
 
 LAYER._fields_ = [("x",  POINTER(MATRIX)),
+                ("cols", POINTER(MATRIX)),
+                ("workspace", POINTER(MATRIX)),
+                ("space_to_depth_w", POINTER(MATRIX)),
+                ("argmax", c_void_p),
+                ("activation_state", c_void_p),
                 ("w", MATRIX),
                 ("dw", MATRIX),
                 ("b", MATRIX),
@@ -49,6 +54,16 @@ LAYER._fields_ = [("x",  POINTER(MATRIX)),
                 ("size", c_int),
                 ("stride", c_int),
                 ("filters", c_int),
+                ("groups", c_int),
+                ("dilation", c_int),
+                ("keep_cols", c_int),
+                ("algorithm", c_int),
+                ("im2col", c_void_p),
+                ("col2im", c_void_p),
+                ("maxpool", c_void_p),
+                ("layout", c_int),
+                ("mode", c_int),
+                ("in_place", c_int),
 
                 ("activation", c_int),
 
@@ -56,17 +71,32 @@ LAYER._fields_ = [("x",  POINTER(MATRIX)),
                 ("x_norm", MATRIX),
                 ("rolling_mean", MATRIX),
                 ("rolling_variance", MATRIX),
+                ("batch_mean", MATRIX),
+                ("batch_rstd", MATRIX),
                 ("forward", CFUNCTYPE(MATRIX, POINTER(LAYER), MATRIX)),
                 ("backward", CFUNCTYPE(MATRIX, POINTER(LAYER), MATRIX)),
                 ("update", CFUNCTYPE(None, POINTER(LAYER), c_float, c_float, c_float))]
 
 class NET(Structure):
     _fields_ = [("layers", POINTER(LAYER)),
-                ("n", c_int)]
+                ("n", c_int),
+                ("layout", c_int),
+                ("mode", c_int)]
 
 
 (LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX) = range(5)
 
+# Tensor layouts, set net.layout to run a net channels-last
+(NCHW, NHWC) = range(2)
+
+# Net modes, set net.mode = EVAL for inference on batches of any size,
+# inference_net(net) also drops everything only training needs
+(TRAIN, EVAL, INFERENCE) = range(3)
+
+# Convolution algorithms, CONV_AUTO layers are tuned on their first TRAIN
+# or INFERENCE batch
+(CONV_GEMM, CONV_DIRECT, CONV_SPACE_TO_DEPTH, CONV_AUTO) = range(4)
+
 
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
@@ -147,6 +177,21 @@ forward_net = lib.forward_net
 forward_net.argtypes = [NET, MATRIX]
 forward_net.restype = MATRIX
 
+net_workspace_size = lib.net_workspace_size
+net_workspace_size.argtypes = [NET]
+net_workspace_size.restype = c_size_t
+
+print_convolution_algorithms = lib.print_convolution_algorithms
+print_convolution_algorithms.argtypes = [NET]
+print_convolution_algorithms.restype = None
+
+set_convolution_cache_lib = lib.set_convolution_cache
+set_convolution_cache_lib.argtypes = [c_char_p]
+set_convolution_cache_lib.restype = None
+
+def set_convolution_cache(f):
+    set_convolution_cache_lib(f.encode('utf-8') if f else None)
+
 load_image_classification_data_lib = lib.load_image_classification_data
 load_image_classification_data_lib.argtypes = [c_char_p, c_char_p]
 load_image_classification_data_lib.restype = DATA
@@ -166,14 +211,38 @@ make_convolutional_layer = lib.make_convolutional_layer
 make_convolutional_layer.argtypes = [c_int, c_int, c_int, c_int, c_int, c_int]
 make_convolutional_layer.restype = LAYER
 
+make_grouped_convolutional_layer = lib.make_grouped_convolutional_layer
+make_grouped_convolutional_layer.argtypes = [c_int, c_int, c_int, c_int, c_int, c_int, c_int]
+make_grouped_convolutional_layer.restype = LAYER
+
+make_dilated_convolutional_layer = lib.make_dilated_convolutional_layer
+make_dilated_convolutional_layer.argtypes = [c_int, c_int, c_int, c_int, c_int, c_int, c_int]
+make_dilated_convolutional_layer.restype = LAYER
+
+make_depthwise_convolutional_layer = lib.make_depthwise_convolutional_layer
+make_depthwise_convolutional_layer.argtypes = [c_int, c_int, c_int, c_int, c_int]
+make_depthwise_convolutional_layer.restype = LAYER
+
 make_maxpool_layer = lib.make_maxpool_layer
 make_maxpool_layer.argtypes = [c_int, c_int, c_int, c_int, c_int]
 make_maxpool_layer.restype = LAYER
 
+make_avgpool_layer = lib.make_avgpool_layer
+make_avgpool_layer.argtypes = [c_int, c_int, c_int, c_int, c_int]
+make_avgpool_layer.restype = LAYER
+
+make_global_avgpool_layer = lib.make_global_avgpool_layer
+make_global_avgpool_layer.argtypes = [c_int, c_int, c_int]
+make_global_avgpool_layer.restype = LAYER
+
 make_batchnorm_layer = lib.make_batchnorm_layer
 make_batchnorm_layer.argtypes = [c_int]
 make_batchnorm_layer.restype = LAYER
 
+make_batchnorm_activation_layer = lib.make_batchnorm_activation_layer
+make_batchnorm_activation_layer.argtypes = [c_int, c_int]
+make_batchnorm_activation_layer.restype = LAYER
+
 save_weights_lib = lib.save_weights
 save_weights_lib.argtypes = [NET, c_char_p]
 save_weights_lib.restype = None
@@ -182,6 +251,14 @@ load_weights_lib = lib.load_weights
 load_weights_lib.argtypes = [NET, c_char_p]
 load_weights_lib.restype = None
 
+fold_batchnorm_net = lib.fold_batchnorm_net
+fold_batchnorm_net.argtypes = [NET]
+fold_batchnorm_net.restype = NET
+
+inference_net = lib.inference_net
+inference_net.argtypes = [NET]
+inference_net.restype = NET
+
 def save_weights(net, f):
     save_weights_lib(net, f.encode('utf-8'))
 
@@ -198,12 +275,18 @@ def run_net_image(net, im):
     m.cols = im.h*im.w*im.c
     m.data = im.data
     m.shallow = 1
-    return forward_net(net, m)
-
-def make_net(layers):
+    mode = net.mode
+    if mode == TRAIN:
+        net.mode = EVAL
+    y = forward_net(net, m)
+    net.mode = mode
+    return y
+
+def make_net(layers, layout=NCHW):
     m = NET()
     m.n = len(layers)
     m.layers = (LAYER*m.n) (*layers)
+    m.layout = layout
     return m
 
 if __name__ == "__main__":